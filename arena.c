@@ -0,0 +1,71 @@
+#include "kernel.h"
+
+// Per-core scratch arenas.
+//
+// Each core gets its own arena of ARENA_PAGES contiguous pages, taken from
+// alloc_pages() the first time the core needs one. Allocating is just bumping a
+// pointer, and freeing happens all at once when the core calls scratch_reset(),
+// e.g. after each packet or batch of packets. Since each core only ever touches
+// its own arena, none of this needs any locking.
+//
+// If an arena runs out of room, scratch_alloc() takes a fresh chunk of at least
+// ARENA_PAGES pages from alloc_pages() (which any core can call), carries on
+// bumping from there, and keeps the chunk on a list so that scratch_reset() can
+// free it too. That should be rare; if it isn't, ARENA_PAGES is too small.
+
+#define ARENA_PAGES 4 // 16 KB of scratch space per core
+#define ARENA_ALIGN 8 // alignment of every scratch allocation
+
+// header for extra chunks taken after the arena filled up
+struct scratch_overflow {
+  struct scratch_overflow *next;
+  unsigned int pages; // size of this chunk, including the header
+};
+
+struct arena {
+  void *base; // start of the arena pages, or 0 if not allocated yet
+  void *next; // next free byte
+  void *end; // one past the last byte
+  struct scratch_overflow *overflow; // extra chunks since the last reset
+};
+
+static DEFINE_PER_CPU(struct arena, arena); // one arena per core
+
+void *scratch_alloc(unsigned int size)
+{
+  struct arena *a = &PER_CPU(arena);
+  if (!a->base) {
+    a->base = a->next = alloc_pages(ARENA_PAGES);
+    a->end = a->base + ARENA_PAGES * PAGE_SIZE;
+  }
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  if (size <= a->end - a->next) {
+    void *p = a->next;
+    a->next += size;
+    return p;
+  }
+  // arena is full, so start on a fresh chunk
+  unsigned int pages = (sizeof(struct scratch_overflow) + size + PAGE_SIZE - 1) / PAGE_SIZE;
+  if (pages < ARENA_PAGES)
+    pages = ARENA_PAGES;
+  struct scratch_overflow *o = alloc_pages(pages);
+  o->next = a->overflow;
+  o->pages = pages;
+  a->overflow = o;
+  void *p = (void *)(o + 1);
+  a->next = p + size;
+  a->end = (void *)o + pages * PAGE_SIZE;
+  return p;
+}
+
+void scratch_reset()
+{
+  struct arena *a = &PER_CPU(arena);
+  a->next = a->base;
+  a->end = a->base + ARENA_PAGES * PAGE_SIZE;
+  while (a->overflow) {
+    struct scratch_overflow *o = a->overflow;
+    a->overflow = o->next;
+    free_pages(o, o->pages);
+  }
+}
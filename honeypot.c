@@ -0,0 +1,344 @@
+#include "kernel.h"
+#include "pool.h"
+
+// Honeypot lists and statistics (see honeypot.h for the packet formats).
+//
+// The three lists (spammer source addresses, evil packet hashes, and
+// vulnerable destination ports) are small chained hash tables. Each entry also
+// counts how many packets matched it. One set of the three lists, along with
+// the pool its entries come from, makes up a shard.
+//
+// Normally there is a single shared shard, protected by one spinlock, since
+// every packet is checked against all three lists at once. With the "sharded"
+// boot parameter, each core that does lookups has a shard of its own instead,
+// and is the only core that ever touches it, so it needs no lock at all. The
+// pipeline then sends each packet to the core whose shard owns its source
+// address (see honeypot_steer()), so the spammer list is split up between the
+// shards, while the evil and vulnerable lists are copied into every shard, by
+// passing those commands through every shard in turn.
+//
+// Totals (packets, bytes, matches) are first added up on each core, then
+// folded into the shared totals every HP_STATS_BATCH packets, or whenever the
+// core runs out of packets, under a seqlock so that honeypot_print_totals()
+// always sees a consistent set of totals. A timer rolls the totals over into a
+// new window every HP_WINDOW_USEC, so the recent rates can be printed along
+// with the averages since boot.
+
+#define HP_BUCKETS 1024 // per list; must be a power of two
+#define HP_STATS_BATCH 32
+#define HP_WINDOW_USEC 1000000 // length of a statistics window
+
+struct hp_entry {
+  struct hp_entry *next;
+  unsigned int key; // address, hash, or port
+  unsigned int hits; // packets that matched this entry
+};
+
+DEFINE_POOL(hp_entry, struct hp_entry, PAGE_SIZE / sizeof(struct hp_entry))
+
+struct hp_list {
+  char *name;
+  unsigned int count; // entries in the list
+  struct hp_entry *bucket[HP_BUCKETS];
+};
+
+struct hp_shard {
+  struct spinlock lock; // protects everything below, unless sharded
+  struct hp_entry_pool entries;
+  struct hp_list spammers, evils, vulnerables;
+};
+
+#define HP_SHARD_INIT { .spammers = { "spammer" }, .evils = { "evil" }, .vulnerables = { "vulnerable" } }
+
+static int hp_sharded; // 1 if each lookup core has its own shard
+static struct hp_shard hp_shared = HP_SHARD_INIT; // the only shard, unless sharded
+static DEFINE_PER_CPU(struct hp_shard, hp_local) = HP_SHARD_INIT; // this core's shard, if sharded
+
+struct hp_totals {
+  unsigned long long packets;
+  unsigned long long bytes;
+  unsigned int commands; // command packets
+  unsigned int spammer, evil, vulnerable; // packets that matched each list
+};
+
+static struct seqlock hp_totals_lock; // protects hp_totals
+static struct hp_totals hp_totals;
+static DEFINE_PER_CPU(struct hp_totals, hp_pending); // not yet folded into hp_totals
+static unsigned int hp_start; // cycle count when the honeypot started
+
+struct hp_window {
+  unsigned long long packets, bytes; // in the window
+  unsigned int usec; // length of the window, or 0 if none has finished yet
+};
+
+static struct timer hp_window_timer;
+static struct hp_totals hp_window_totals; // totals when the current window began
+static unsigned int hp_window_cycles; // cycle count when the current window began
+static struct seqlock hp_window_lock; // protects hp_last_window
+static struct hp_window hp_last_window; // the last window to finish
+static volatile unsigned int hp_first_packet; // set once the first packet is done
+
+static inline unsigned int be32(unsigned int x)
+{
+  return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+static inline unsigned short be16(unsigned short x)
+{
+  return (x >> 8) | (x << 8);
+}
+
+// end the current statistics window, and start a new one
+static void hp_window_rollover(void *arg)
+{
+  // this runs in the timer interrupt, which might have interrupted an update of
+  // hp_totals on this very core, so rather than wait for the update to finish,
+  // just let the window run on until the next tick
+  unsigned int seq = hp_totals_lock.seq;
+  if (seq & 1)
+    return;
+  compiler_barrier();
+  struct hp_totals t = hp_totals;
+  if (seq_read_retry(&hp_totals_lock, seq))
+    return;
+  unsigned int now = current_cpu_cycles();
+  seq_write_lock(&hp_window_lock);
+  hp_last_window.packets = t.packets - hp_window_totals.packets;
+  hp_last_window.bytes = t.bytes - hp_window_totals.bytes;
+  hp_last_window.usec = (now - hp_window_cycles) / CPU_CYCLES_PER_USEC;
+  seq_write_unlock(&hp_window_lock);
+  hp_window_totals = t;
+  hp_window_cycles = now;
+}
+
+void honeypot_init()
+{
+  hp_start = hp_window_cycles = current_cpu_cycles();
+  hp_sharded = (bootparam("sharded") != 0);
+  unsigned int period = timer_usec_to_ticks(HP_WINDOW_USEC);
+  if (period)
+    timer_every(&hp_window_timer, period, hp_window_rollover, 0);
+}
+
+int honeypot_is_sharded()
+{
+  return hp_sharded;
+}
+
+// shard for this core to use, with its lock held if it is shared
+static struct hp_shard *hp_shard_begin()
+{
+  if (hp_sharded)
+    return &PER_CPU(hp_local);
+  spin_lock(&hp_shared.lock);
+  return &hp_shared;
+}
+
+static void hp_shard_end(struct hp_shard *shard)
+{
+  if (!hp_sharded)
+    spin_unlock(&shard->lock);
+}
+
+// djb2, as used for the evil packet list
+unsigned int honeypot_hash(void *pkt, unsigned int len)
+{
+  unsigned char *p = pkt;
+  unsigned int hash = 5381;
+  for (int i = 0; i < len; i++)
+    hash = hash * 33 + p[i];
+  return hash;
+}
+
+void honeypot_parse(void *pkt, unsigned int len, struct hp_packet *p)
+{
+  struct honeypot_command_packet *c = pkt;
+  p->len = len;
+  p->flags = 0;
+  p->source = be32(c->headers.ip_source_address_big_endian);
+  p->port = be16(c->headers.udp_dest_port_big_endian);
+  p->hash = honeypot_hash(pkt, len);
+  if (len >= HONEYPOT_CMD_PKT_MIN_LEN && be16(c->secret_big_endian) == HONEYPOT_SECRET) {
+    p->flags |= HP_COMMAND;
+    p->cmd = be16(c->cmd_big_endian);
+    p->data = be32(c->data_big_endian);
+  }
+}
+
+int honeypot_steer(void *pkt, unsigned int len, unsigned int *key)
+{
+  struct honeypot_command_packet *c = pkt;
+  if (len >= HONEYPOT_CMD_PKT_MIN_LEN && be16(c->secret_big_endian) == HONEYPOT_SECRET) {
+    unsigned int cmd = be16(c->cmd_big_endian);
+    if (cmd != HONEYPOT_ADD_SPAMMER && cmd != HONEYPOT_DEL_SPAMMER)
+      return 1; // every shard needs to see this one
+    *key = be32(c->data_big_endian); // the shard that owns the address
+    return 0;
+  }
+  *key = be32(c->headers.ip_source_address_big_endian);
+  return 0;
+}
+
+// find the entry for key, or 0 if it is not in the list; the shard must be held
+static struct hp_entry *hp_find(struct hp_list *list, unsigned int key)
+{
+  struct hp_entry *e = list->bucket[key & (HP_BUCKETS - 1)];
+  while (e && e->key != key)
+    e = e->next;
+  return e;
+}
+
+// the shard must be held
+static void hp_add(struct hp_shard *shard, struct hp_list *list, unsigned int key)
+{
+  if (hp_find(list, key))
+    return;
+  struct hp_entry *e = hp_entry_pool_alloc(&shard->entries);
+  e->key = key;
+  e->hits = 0;
+  e->next = list->bucket[key & (HP_BUCKETS - 1)];
+  list->bucket[key & (HP_BUCKETS - 1)] = e;
+  list->count++;
+}
+
+// the shard must be held
+static void hp_del(struct hp_shard *shard, struct hp_list *list, unsigned int key)
+{
+  for (struct hp_entry **p = &list->bucket[key & (HP_BUCKETS - 1)]; *p; p = &(*p)->next) {
+    if ((*p)->key == key) {
+      struct hp_entry *e = *p;
+      *p = e->next;
+      hp_entry_pool_free(&shard->entries, e);
+      list->count--;
+      return;
+    }
+  }
+}
+
+// count a match against key, if it is in the list; returns 1 if it was; the
+// shard must be held
+static int hp_hit(struct hp_list *list, unsigned int key)
+{
+  struct hp_entry *e = hp_find(list, key);
+  if (!e)
+    return 0;
+  e->hits++;
+  return 1;
+}
+
+void honeypot_lookup(struct hp_packet *p)
+{
+  if ((p->flags & HP_COMMAND) && p->cmd == HONEYPOT_PRINT)
+    return; // see honeypot_print_totals() and honeypot_print_lists()
+  struct hp_shard *shard = hp_shard_begin();
+  if (p->flags & HP_COMMAND) {
+    switch (p->cmd) {
+      case HONEYPOT_ADD_SPAMMER: hp_add(shard, &shard->spammers, p->data); break;
+      case HONEYPOT_ADD_EVIL: hp_add(shard, &shard->evils, p->data); break;
+      case HONEYPOT_ADD_VULNERABLE: hp_add(shard, &shard->vulnerables, p->data & 0xffff); break;
+      case HONEYPOT_DEL_SPAMMER: hp_del(shard, &shard->spammers, p->data); break;
+      case HONEYPOT_DEL_EVIL: hp_del(shard, &shard->evils, p->data); break;
+      case HONEYPOT_DEL_VULNERABLE: hp_del(shard, &shard->vulnerables, p->data & 0xffff); break;
+      default:
+	printf("honeypot: unknown command 0x%x\n", p->cmd);
+	break;
+    }
+  } else {
+    if (hp_hit(&shard->spammers, p->source))
+      p->flags |= HP_SPAMMER;
+    if (hp_hit(&shard->evils, p->hash))
+      p->flags |= HP_EVIL;
+    if (hp_hit(&shard->vulnerables, p->port))
+      p->flags |= HP_VULNERABLE;
+  }
+  hp_shard_end(shard);
+}
+
+void honeypot_account(struct hp_packet *p)
+{
+  struct hp_totals *t = &PER_CPU(hp_pending);
+  t->packets++;
+  t->bytes += p->len;
+  if (p->flags & HP_COMMAND)
+    t->commands++;
+  if (p->flags & HP_SPAMMER)
+    t->spammer++;
+  if (p->flags & HP_EVIL)
+    t->evil++;
+  if (p->flags & HP_VULNERABLE)
+    t->vulnerable++;
+  if (t->packets >= HP_STATS_BATCH)
+    honeypot_stats_flush();
+  if (!hp_first_packet && atomic_swap(&hp_first_packet, 1) == 0)
+    printf("honeypot: first packet done %u cycles after boot\n", current_cpu_cycles());
+}
+
+void honeypot_stats_flush()
+{
+  struct hp_totals *t = &PER_CPU(hp_pending);
+  if (!t->packets)
+    return;
+  seq_write_lock(&hp_totals_lock);
+  hp_totals.packets += t->packets;
+  hp_totals.bytes += t->bytes;
+  hp_totals.commands += t->commands;
+  hp_totals.spammer += t->spammer;
+  hp_totals.evil += t->evil;
+  hp_totals.vulnerable += t->vulnerable;
+  seq_write_unlock(&hp_totals_lock);
+  *t = (struct hp_totals){ 0 };
+}
+
+static void hp_print_list(struct hp_list *list, int hex)
+{
+  printf("  %d %s entries:\n", list->count, list->name);
+  for (int i = 0; i < HP_BUCKETS; i++) {
+    for (struct hp_entry *e = list->bucket[i]; e; e = e->next) {
+      if (hex)
+	printf("    0x%08x: %u packets\n", e->key, e->hits);
+      else
+	printf("    %d: %u packets\n", e->key, e->hits);
+    }
+  }
+}
+
+void honeypot_print_totals()
+{
+  honeypot_stats_flush();
+  struct hp_totals t;
+  unsigned int seq;
+  do {
+    seq = seq_read_begin(&hp_totals_lock);
+    t = hp_totals;
+  } while (seq_read_retry(&hp_totals_lock, seq));
+  unsigned int usec = (current_cpu_cycles() - hp_start) / CPU_CYCLES_PER_USEC;
+  if (usec == 0)
+    usec = 1;
+
+  printf("honeypot statistics:\n");
+  printf("  %u packets, %u bytes in %u ms (%u packets/s, %u kbit/s)\n",
+      (unsigned int)t.packets, (unsigned int)t.bytes, usec / 1000,
+      (unsigned int)(t.packets * 1000000 / usec), (unsigned int)(t.bytes * 8000 / usec));
+  printf("  %u commands, %u spammer, %u evil, %u vulnerable, %u dropped\n",
+      t.commands, t.spammer, t.evil, t.vulnerable, network_dropcount());
+
+  struct hp_window w;
+  do {
+    seq = seq_read_begin(&hp_window_lock);
+    w = hp_last_window;
+  } while (seq_read_retry(&hp_window_lock, seq));
+  if (w.usec)
+    printf("  last %u ms: %u packets/s, %u kbit/s\n", w.usec / 1000,
+	(unsigned int)(w.packets * 1000000 / w.usec), (unsigned int)(w.bytes * 8000 / w.usec));
+}
+
+void honeypot_print_lists()
+{
+  struct hp_shard *shard = hp_shard_begin();
+  if (hp_sharded)
+    printf("shard on core %d:\n", current_cpu_id());
+  hp_print_list(&shard->spammers, 1);
+  hp_print_list(&shard->evils, 1);
+  hp_print_list(&shard->vulnerables, 0);
+  hp_shard_end(shard);
+}
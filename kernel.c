@@ -4,6 +4,34 @@ struct bootparams *bootparams;
 
 int debug = 1; // change to 0 to stop seeing so many messages
 
+char *bootparam(char *name)
+{
+  for (int i = 0; i < 16; i++) {
+    char *arg = bootparams->argdata[i];
+    int j;
+    for (j = 0; name[j] != '\0' && arg[j] == name[j]; j++)
+      ;
+    if (name[j] != '\0')
+      continue;
+    if (arg[j] == '\0')
+      return &arg[j];
+    if (arg[j] == '=')
+      return &arg[j+1];
+  }
+  return 0;
+}
+
+int bootparam_int(char *name, int def)
+{
+  char *value = bootparam(name);
+  if (!value || *value == '\0')
+    return def;
+  int n = 0;
+  for (; *value >= '0' && *value <= '9'; value++)
+    n = n * 10 + (*value - '0');
+  return n;
+}
+
 void shutdown() {
   puts("Shutting down...");
   // this is really the "wait" instruction, which gcc doesn't seem to know about
@@ -15,30 +43,29 @@ void shutdown() {
 /* Trap handling.
  *
  * Only core 0 will get interrupts, but any core can get an exception (or
- * syscall).  So we allocate enough space for every core i to have its own place
- * to store register state (trap_save_state[i]), its own stack to use in the
- * interrupt handler (trap_stack_top[i]), and a valid $gp to use during
- * interrupt handling (trap_gp[i]).
+ * syscall).  So every core has its own per-core copy of a place to store
+ * register state (trap_save_state), a stack to use in the interrupt handler
+ * (trap_stack_top), and a valid $gp to use during interrupt handling (trap_gp).
+ * The trap handler in trap.s finds them using percpu_offset[].
  */
 
-struct mips_core_data *trap_save_state[MAX_CORES]; /* one save-state per core */
-void *trap_stack_top[MAX_CORES]; /* one trap stack per core */
-unsigned int trap_gp[MAX_CORES]; /* one trap $gp per core */
+DEFINE_PER_CPU(struct mips_core_data *, trap_save_state); /* one save-state per core */
+DEFINE_PER_CPU(void *, trap_stack_top); /* one trap stack per core */
+DEFINE_PER_CPU(unsigned int, trap_gp); /* one trap $gp per core */
 
 void trap_init()
 {
-  int id = current_cpu_id();
-
   /* trap should use the same $gp as the current code */
-  trap_gp[id] = current_cpu_gp();
+  PER_CPU(trap_gp) = current_cpu_gp();
 
   /* trap should use a fresh stack */
   void *bottom = alloc_pages(4);
-  trap_stack_top[id] = bottom + 4*PAGE_SIZE - 4;
+  void *top = bottom + 4*PAGE_SIZE - 4;
 
   /* put the trap save-state at the top of the corresponding trap stack */
-  trap_stack_top[id] -= sizeof(struct mips_core_data);
-  trap_save_state[id] = trap_stack_top[id];
+  top -= sizeof(struct mips_core_data);
+  PER_CPU(trap_stack_top) = top;
+  PER_CPU(trap_save_state) = top;
 
   /* it is now safe to take interrupts on this core */
   intr_restore(1);
@@ -58,7 +85,7 @@ void interrupt_handler(int cause)
   }
 
   if (pending_interrupts & (1 << INTR_TIMER)) {
-    printf("interrupt_handler: got a spurious timer interrupt, ignoring it and hoping it doesn't happen again\n");
+    timer_interrupt();
     unhandled_interrupts &= ~(1 << INTR_TIMER);
   }
 
@@ -70,9 +97,10 @@ void interrupt_handler(int cause)
 
 void trap_handler(struct mips_core_data *state, unsigned int status, unsigned int cause)
 {
-  if (debug) printf("trap_handler: status=0x%08x cause=0x%08x on core %d\n", status, cause, current_cpu_id());
   // diagnose the cause of the trap
   int ecode = (cause & 0x7c) >> 2;
+  // (interrupts, e.g. every timer tick, are too frequent to report here)
+  if (debug && ecode != ECODE_INT) printf("trap_handler: status=0x%08x cause=0x%08x on core %d\n", status, cause, current_cpu_id());
   switch (ecode) {
     case ECODE_INT:	  /* external interrupt */
       interrupt_handler(cause);
@@ -117,6 +145,27 @@ void trap_handler(struct mips_core_data *state, unsigned int status, unsigned in
 }
 
 
+/* Multi-core bring-up.
+ *
+ * Core 0 does all of the shared initialization, sets boot_init_done, and only
+ * then turns on the other cores. Each of those does its own per-core setup,
+ * then sets its bit in boot_ready, and all of the cores meet at boot_barrier
+ * before going on to real work. Nobody has to guess how long anything takes.
+ */
+
+static volatile unsigned int boot_init_done; // set by core 0 once it is safe for other cores to run
+static volatile unsigned int boot_ready; // bit i is set once core i has finished its setup
+static unsigned int boot_enable_cycles; // cycle count when core 0 turned on the other cores
+static struct barrier boot_barrier;
+
+static void boot_mark_ready(unsigned int id)
+{
+  unsigned int v;
+  do {
+    v = boot_ready;
+  } while (atomic_cas(&boot_ready, v, v | (1 << id)) != v);
+}
+
 /* kernel entry point called at the end of the boot sequence */
 void __boot() {
 
@@ -136,55 +185,84 @@ void __boot() {
     // initialize memory allocators
     mem_init();
 
+    // give every core its own copy of the per-core variables
+    percpu_init();
+
+    // optionally measure memset(), memcpy() and friends
+    if (bootparam("membench"))
+      mem_benchmark();
+
     // prepare to handle interrupts, exceptions, etc.
     trap_init();
 
     // initialize keyboard late, since it isn't really used by anything else
     keyboard_init();
 
-    // see which cores are already on
-    for (int i = 0; i < 32; i++)
-      printf("CPU[%d] is %s\n", i, (current_cpu_enable() & (1<<i)) ? "on" : "off");
+    // start the periodic timer tick
+    timer_init();
+
+    // start receiving packets, if there is a network card
+    if (network_init()) {
+      honeypot_init();
+      pipeline_init();
+    }
+
+    // let the other cores know everything they depend on is set up
+    boot_init_done = 1;
+    boot_enable_cycles = current_cpu_cycles();
 
     // turn on all other cores
     set_cpu_enable(0xFFFFFFFF);
 
-    // see which cores got turned on
-    busy_wait(0.1);
-    for (int i = 0; i < 32; i++)
-      printf("CPU[%d] is %s\n", i, (current_cpu_enable() & (1<<i)) ? "on" : "off");
-
   } else {
     /* remaining cores boot after core 0 turns them on */
 
-    // nothing to initialize here... 
-  }
+    // wait for core 0 to finish initializing, in case we were turned on early
+    while (!boot_init_done)
+      ;
 
-  printf("Core %d of %d is alive!\n", current_cpu_id(), current_cpu_exists());
+    // switch to this core's own copy of the per-core variables
+    percpu_enter();
 
-  busy_wait(current_cpu_id() * 0.1); // wait a while so messages from different cores don't get so mixed up
-  int size = 64 * 1024 * 4;
-  printf("about to do calloc(%d, 1)\n", size);
-  unsigned int t0  = current_cpu_cycles();
-  calloc(size, 1);
-  unsigned int t1  = current_cpu_cycles();
-  printf("DONE (%u cycles)!\n", t1 - t0);
+    // prepare to handle exceptions on this core too
+    trap_init();
+  }
 
-  while (1) ;
+  // check in, then wait for all other cores to do the same
+  boot_mark_ready(current_cpu_id());
+  barrier_wait(&boot_barrier, current_cpu_exists());
 
-  for (int i = 1; i < 30; i++) {
-    int size = 1 << i;
+  if (current_cpu_id() == 0) {
+    unsigned int t = current_cpu_cycles();
+    printf("All %d cores ready (bitmap 0x%08x) after %u cycles, %u after turning them on\n",
+	current_cpu_exists(), boot_ready, t, t - boot_enable_cycles);
+  }
+
+  if (current_cpu_id() == 0) {
+    // malloc() and friends are not synchronized, so only one core tries them
+    int size = 64 * 1024 * 4;
     printf("about to do calloc(%d, 1)\n", size);
+    unsigned int t0  = current_cpu_cycles();
     calloc(size, 1);
+    unsigned int t1  = current_cpu_cycles();
+    printf("DONE (%u cycles)!\n", t1 - t0);
   }
 
+  // optionally compare the different locks; every core has to take part
+  if (bootparam("lockbench"))
+    lock_benchmark();
 
-
-  while (1) {
-    printf("Core %d is still running...\n", current_cpu_id());
-    busy_wait(4.0); // wait 4 seconds
+  if (current_cpu_id() == 0 && bootparam("memstats")) {
+    mem_print_stats();
+    heap_profile_dump();
   }
 
-  shutdown();
+  // optionally check how well the scheduler spreads out uneven work
+  if (current_cpu_id() == 0 && bootparam("schedbench"))
+    sched_benchmark();
+
+  // from now on, just process packets and run whatever work gets submitted
+  pipeline_start();
+  sched_run(); // never returns
 }
 
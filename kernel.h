@@ -5,6 +5,7 @@
 #include "honeypot.h"
 #include "console.h"
 #include "keyboard.h"
+#include "network.h"
 
 /* This is used by the trap handler to save the CPU state
  * Note: So long as trap handlers do not touch any coprocessor state (e.g.
@@ -27,6 +28,15 @@ extern struct bootparams *bootparams;
 extern int debug;
 void shutdown() __attribute__ ((noreturn));
 
+// look up a boot parameter given on the simulator command line, either of the
+// form "name=value", in which case this returns "value", or just "name", in
+// which case this returns ""; returns 0 if there is no such parameter
+char *bootparam(char *name);
+
+// same as bootparam(), but for parameters of the form "name=number"; returns
+// the number, or def if there is no such parameter
+int bootparam_int(char *name, int def);
+
 
 
 /* machine.s */
@@ -61,6 +71,7 @@ unsigned int current_cpu_cause(); // MIPS 'Cause' register
 unsigned int current_cpu_epc(); // MIPS 'EPC' register
 unsigned int current_cpu_badvaddr(); // MIPS 'BadVaddr' register
 unsigned int current_cpu_cycles(); // MIPS 'Cycles' register (number of cycles since boot)
+unsigned int current_cpu_compare(); // MIPS 'Compare' register (timer interrupt goes off when 'Cycles' reaches this)
 unsigned int current_cpu_gp(); // $gp register
 
 unsigned int set_cpu_enable(unsigned int mask); // turns on more cores by writing new 1 bits to enable register
@@ -70,6 +81,68 @@ unsigned int set_cpu_status(unsigned int status);
 unsigned int set_cpu_cause(unsigned int cause);
 unsigned int set_cpu_epc(unsigned int epc);
 unsigned int set_cpu_badvaddr(unsigned int badvaddr);
+unsigned int set_cpu_compare(unsigned int compare); // also clears any pending timer interrupt
+
+/* Locks and atomic operations built on the MIPS LL and SC instructions are
+ * declared in sync.h, which needs MAX_CORES from above. */
+#include "sync.h"
+
+
+/* percpu.c */
+
+/* Per-core variables.
+ *
+ * A variable defined with DEFINE_PER_CPU() goes in the .percpu section of the
+ * kernel image, which serves as the template for every core's copy. At boot,
+ * percpu_init() gives each other core a fresh copy of the whole section, so
+ * all of one core's variables sit together, on pages that no other core
+ * normally writes. Core 0 uses the template itself.
+ *
+ *  DEFINE_PER_CPU(struct foo, foo); // or "static DEFINE_PER_CPU(...)"
+ *  ...
+ *  PER_CPU(foo).count++; // this core's copy
+ *  PER_CPU_OF(foo, 3).count; // core 3's copy
+ *
+ * With PERCPU_PRIVATE_MAPPING, each other core also gets its own copy of the
+ * page directory, and of the one page table that covers .percpu, with the
+ * .percpu pages remapped to that core's copy. Every core then sees its own
+ * copy at the template's virtual address, so PER_CPU(foo) is just foo: a
+ * plain global access, with no current_cpu_id() or indexing. Without it,
+ * every core shares one page directory, and each use of PER_CPU() reads
+ * current_cpu_id() and percpu_offset[] again, so code that touches several
+ * per-core variables in a row may want to take pointers to them first, e.g.
+ * "struct foo *f = &PER_CPU(foo);".
+ *
+ * Either way, PER_CPU_OF() reaches other cores' copies through their
+ * 0xC0000000 + physical address mapping, which all cores share. Note that with
+ * PERCPU_PRIVATE_MAPPING, &PER_CPU(foo) means the same thing on every core, so
+ * such pointers must not be handed to other cores.
+ */
+
+#define PERCPU_PRIVATE_MAPPING 1 // change to 0 to share one page directory between all cores
+
+#define DEFINE_PER_CPU(type, name) \
+  type name __attribute__ ((section(".percpu")))
+#define DECLARE_PER_CPU(type, name) \
+  extern type name
+
+extern unsigned int percpu_offset[MAX_CORES]; // from each variable's template to core i's copy
+
+#define PER_CPU_OF(var, id) \
+  (*(__typeof__(&(var)))((char *)&(var) + percpu_offset[id]))
+#if PERCPU_PRIVATE_MAPPING
+#define PER_CPU(var) (var)
+#else
+#define PER_CPU(var) PER_CPU_OF(var, current_cpu_id())
+#endif
+
+// copy the .percpu template for every other core; call once, from core 0,
+// after mem_init() and before any other core starts
+void percpu_init();
+
+// switch this core over to its own copy of the per-core variables; every core
+// other than 0 must call this before touching any of them
+void percpu_enter();
 
 
 /* intr.c */
@@ -112,17 +185,39 @@ unsigned int virtual_to_physical(void *vptr); // return physical address that gi
 // standard library helpers
 void *memset(void *s, unsigned int c, unsigned int len);
 void *memcpy(void *dest, const void *src, unsigned int len);
+void *memmove(void *dest, const void *src, unsigned int len); // like memcpy, but dest and src may overlap
+int memcmp(const void *a, const void *b, unsigned int len);
+
+// print cycle counts for the above helpers over a range of sizes
+void mem_benchmark();
 
 // fast, underlying page-at-a-time memory management
-// note: These are not synchronized in any way. If multiple cores are going to
-// call these functions, then every access to these need to be use some
-// multi-core safe synchronization. And if interrupt handlers are going to call
-// these functions, then every access to these needs to use interrupt-safe
-// synchronization too.
+// note: These are safe to call from any core and from interrupt handlers.
+// Single pages come from (and go back to) a per-core cache without locking;
+// everything else is protected by a spinlock, with interrupts disabled while it
+// is held.
 void *alloc_pages(unsigned int count); // allocate count pages of physically (and virtually) contiguous memory
 void *calloc_pages(unsigned int count); // allocate and clear count pages of physically (and virtually) contiguous memory
 void free_pages(void *page, unsigned int count); // free count contiguous pages that came from page_alloc() and/or page_calloc()
 
+// DMA memory management
+// DMA memory comes from a physically contiguous region set aside at boot. The
+// physical address of DMA memory is always its virtual address minus
+// DMA_VIRT_OFFSET, so drivers can translate with dma_to_physical() and
+// physical_to_dma() instead of walking page tables. These are protected by a
+// spinlock, with interrupts disabled while it is held.
+void *dma_alloc(unsigned int count); // allocate count pages of physically contiguous DMA memory
+void dma_free(void *page, unsigned int count); // free count pages that came from dma_alloc()
+
+#define DMA_VIRT_OFFSET 0xC0000000
+static inline unsigned int dma_to_physical(void *vptr) { return (unsigned int)vptr - DMA_VIRT_OFFSET; }
+static inline void *physical_to_dma(unsigned int paddr) { return (void *)(paddr + DMA_VIRT_OFFSET); }
+
+// background memory chores, e.g. zeroing free pages ahead of time so that
+// calloc_pages() and calloc() don't have to; cores with nothing else to do
+// should call this repeatedly; returns 1 if it did some work, 0 otherwise
+int mem_idle();
+
 // standard memory management
 // note: These are not synchronized in any way. If multiple cores are going to
 // call these functions, then every access to these need to be use some
@@ -131,16 +226,150 @@ void free_pages(void *page, unsigned int count); // free count contiguous pages
 // synchronization too.
 void *malloc(unsigned int size); // allocate size bytes of memory
 void *calloc(unsigned int size, unsigned int count); // allocate and clear (size * count) bytes of memory
-void free(void *p); // free a pointer that came from malloc() or calloc()
+void *realloc(void *p, unsigned int size); // resize a block from malloc(), in place if possible, else by moving it
+void free(void *p); // free a pointer that came from malloc(), calloc(), realloc(), or vmalloc()
+
+// virtually contiguous memory management
+// note: These are not synchronized either, same as malloc() and friends.
+// Memory from vmalloc() is backed by individual RAM pages, so it is only
+// virtually contiguous, never physically contiguous. It should be freed with
+// free(), same as memory from malloc(). The malloc() function falls back to
+// this automatically when RAM is too fragmented for large allocations.
+void *vmalloc(unsigned int size); // allocate size bytes of virtually contiguous memory
+
+// print counters for each malloc() blocksize, page allocator usage and
+// fragmentation, and sampled cycle costs of malloc(), free() and alloc_pages()
+void mem_print_stats();
+
+// print live bytes by malloc() and calloc() call site, estimated from samples
+// taken when the "heapprof=N" boot parameter is given
+void heap_profile_dump();
+
+
+/* arena.c */
+
+// Per-core scratch memory for short-lived allocations, e.g. while processing a
+// single packet. These are safe to call from any core, since each core has its
+// own arena, but not from interrupt handlers.
+void *scratch_alloc(unsigned int size); // allocate size bytes from this core's arena
+void scratch_reset(); // free everything this core allocated since its last reset
+
+
+/* sched.c */
+
+// Work-stealing scheduler. Each core keeps its own queue of work items, and
+// cores that run out of work steal from others. Work can be submitted from any
+// core, but not from interrupt handlers.
+void sched_submit(void (*fn)(void *arg), void *arg); // queue fn(arg) to run on this core, or on whichever core steals it
+void sched_run(); // run work items forever, stealing when there are none locally, and running background tasks (including mem_idle() chores) in the gaps
+void sched_set_poll(int (*poll)()); // have sched_run() on this core call poll() first, every time around; it should return 1 if it found work
+void sched_print_stats(); // print per-core counts of items run and stolen
+
+// Same as memset() and memcpy(), but jobs of 64 KB or more are split into
+// page-aligned chunks and spread over any cores that are idle in sched_run(),
+// returning once every chunk is done. Safe to call from any core, but not from
+// interrupt handlers. Since they wait for other cores, don't hold a lock across
+// one of these (or a big calloc() or realloc(), which use them) that work items
+// or tasks on other cores might need.
+void *parallel_memset(void *s, unsigned int c, unsigned int len);
+void *parallel_memcpy(void *dest, const void *src, unsigned int len);
+
+// submit a batch of hashing work with very uneven sizes, and print how evenly
+// it ends up spread across cores; the other cores must be in sched_run()
+void sched_benchmark();
+
+
+/* timer.c */
+
+// Periodic timer tick on core 0 (see timer.c), for anything time-based that
+// would otherwise have to poll current_cpu_cycles(). A struct timer can live
+// anywhere (e.g. a global, or inside the structure it is about), and must stay
+// put until it fires or is cancelled. Callbacks run on core 0, inside the
+// timer interrupt handler with interrupts off, so they should be quick, e.g.
+// roll over a stats window, sample a counter, or hand real work off somewhere.
+// Times are in ticks. All of these are safe to call from any core. A callback
+// that was already due when its timer got cancelled might still run once more.
+
+struct timer {
+  struct timer *next; // next timer in the same wheel slot
+  unsigned int expires; // tick when this is due
+  unsigned int period; // ticks between calls, or 0 to call only once
+  void (*fn)(void *arg);
+  void *arg;
+};
+
+void timer_init(); // start ticking; call once, from core 0, after trap_init()
+void timer_interrupt(); // called by interrupt_handler() for each timer interrupt
+unsigned int timer_ticks(); // ticks since timer_init()
+unsigned int timer_usec_to_ticks(unsigned int usec); // ticks in usec microseconds (at least 1), or 0 if the timer is off
+void timer_add(struct timer *t, unsigned int delay, void (*fn)(void *arg), void *arg); // call fn(arg) once, delay ticks from now, replacing whatever t was set to do
+void timer_every(struct timer *t, unsigned int period, void (*fn)(void *arg), void *arg); // call fn(arg) every period ticks, starting period ticks from now, replacing whatever t was set to do
+int timer_cancel(struct timer *t); // stop a timer; returns 1 if it was still pending
+void timer_print_stats(); // print ticks so far and how many were handled late
+
+
+/* honeypot.c */
+
+// The honeypot's lists of spammers, evil packets and vulnerable ports, and its
+// statistics. These are safe to call from any core, but not from interrupt
+// handlers.
+
+#define HP_COMMAND    0x1 // packet is a honeypot command
+#define HP_SPAMMER    0x2 // source address is on the spammer list
+#define HP_EVIL       0x4 // hash is on the evil list
+#define HP_VULNERABLE 0x8 // destination port is on the vulnerable list
+
+// what the honeypot needs to know about one packet
+struct hp_packet {
+  unsigned int len;
+  unsigned int flags; // HP_COMMAND, HP_SPAMMER, etc.
+  unsigned int source; // IP source address
+  unsigned int port; // UDP destination port
+  unsigned int hash; // djb2 hash of the whole packet
+  unsigned int cmd, data; // for command packets
+};
+
+void honeypot_init(); // start the statistics clock and windows, and see if the lists are sharded; call after timer_init()
+int honeypot_is_sharded(); // 1 if each lookup core has a shard of the lists to itself
+int honeypot_steer(void *pkt, unsigned int len, unsigned int *key); // set the key that picks a packet's shard, or return 1 if it goes to every shard
+unsigned int honeypot_hash(void *pkt, unsigned int len); // the hash used for evil packets
+void honeypot_parse(void *pkt, unsigned int len, struct hp_packet *p); // fill in p from the raw packet, including its hash
+void honeypot_lookup(struct hp_packet *p); // carry out a command, or check the lists and set p->flags
+void honeypot_account(struct hp_packet *p); // add a finished packet to this core's statistics
+void honeypot_stats_flush(); // fold this core's statistics into the shared totals
+void honeypot_print_totals(); // print the shared totals, and the rates over the last window
+void honeypot_print_lists(); // print every list (only this core's shard, if sharded)
+
+
+/* pipeline.c */
+
+// The packet path, split into stages that are connected by queues: ring drain
+// (RX), packet hashing, list lookup, and statistics. Which cores run which
+// stages is picked at boot (see pipeline.c); a core that runs several stages
+// in a row does them all at once, without queueing in between.
+void pipeline_init(); // pick the stage of each core; call once, from core 0, after network_init()
+void pipeline_start(); // start running this core's stages from sched_run()
+void pipeline_print_stats(); // print per-core counts of packets through each stage
+
+
+/* task.c */
+
+// Cooperative background tasks, e.g. for stats rendering or table compaction.
+// Each task runs on its own stack until it calls task_yield(), and each core
+// runs only the tasks spawned on it. None of these can be called from
+// interrupt handlers.
+void task_spawn(void (*fn)(void *arg), void *arg); // start fn(arg) as a new task on this core; it ends when fn returns
+void task_yield(); // let the next ready task on this core run for a while; returns right away if there are none
+void task_print_stats(); // print per-core counts of tasks and task switches
 
 
 /* printf.c */
 
 int printf_u(const char *format, ...); // unsynchronized
-//int printf_m(const char *format, ...); // protected by a mutex
+int printf_m(const char *format, ...); // protected by a mutex
 int printf_i(const char *format, ...); // protected by a interrupt-disable
-//int printf_mi(const char *format, ...); // protected by a mutex followed by interrupt-disable
-int printf(const char *format, ...); // protected by something or other
+int printf_im(const char *format, ...); // protected by interrupt-disable followed by a mutex
+int printf(const char *format, ...); // same as printf_im
 int sprintf(char *out, const char *format, ...);
 
 #endif // _KERNEL_H_
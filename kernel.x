@@ -101,6 +101,18 @@ SECTIONS
     SORT(CONSTRUCTORS)
   }
   .data1          : { *(.data1) }
+  /* Per-core variables (see DEFINE_PER_CPU in kernel.h). This is the template
+     that percpu_init() copies for each core, so it starts and ends on a page
+     boundary, which lets each core map its own copy in place of these pages
+     and keeps the copies from sharing cache lines.  */
+  . = ALIGN(0x1000);
+  .percpu         :
+  {
+    __percpu_start = .;
+    KEEP (*(.percpu))
+    . = ALIGN(0x1000);
+    __percpu_end = .;
+  }
   . = .;
   _gp = ALIGN(16) + 0x7ff0;
   .got            : { *(.got.plt) *(.got) }
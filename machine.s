@@ -62,6 +62,14 @@ current_cpu_cycles:
   jr $ra
 .end	current_cpu_cycles
 
+.global current_cpu_compare
+.ent	current_cpu_compare
+.type	current_cpu_compare, @function
+current_cpu_compare:
+  mfc0 $2, $11
+  jr $ra
+.end	current_cpu_compare
+
 .global current_cpu_id
 .ent	current_cpu_id
 .type	current_cpu_id, @function
@@ -128,6 +136,14 @@ set_cpu_badvaddr:
   jr $ra
 .end	set_cpu_badvaddr
 
+.global set_cpu_compare
+.ent	set_cpu_compare
+.type	set_cpu_compare, @function
+set_cpu_compare:
+  mtc0 $4, $11
+  jr $ra
+.end	set_cpu_compare
+
 .global set_cpu_enable
 .ent	set_cpu_enable
 .type	set_cpu_enable, @function
@@ -135,3 +151,192 @@ set_cpu_enable:
   mtc2 $4, $17
   jr $ra
 .end	set_cpu_enable
+
+/* spinlocks and ticket locks (see sync.h) */
+
+/* unsigned int spin_acquire(volatile unsigned int *word)
+ * wait until *word is 0, then set it to 1; returns the number of failed tries */
+.global spin_acquire
+.ent	spin_acquire
+.type	spin_acquire, @function
+spin_acquire:
+  .set mips2 /* tell compiler it is okay to use mips2 LL and SC instructions */
+  move $2, $0       /* r2 = count of failed tries */
+  b 2f
+1:
+  addiu $2, $2, 1
+2:
+  ll $8, 0($4)      /* r8 = *word, and start watching the lock word */
+  bnez $8, 1b       /* someone else holds it, so try again */
+  li $8, 1
+  sc $8, 0($4)      /* *word = 1, but only if nobody wrote it since the ll */
+  beqz $8, 1b       /* someone else got there first, so try again */
+  .set mips1 /* tell compiler to use only mips1 instructions */
+  jr $ra
+.end	spin_acquire
+
+/* int spin_try(volatile unsigned int *word)
+ * if *word is 0, set it to 1 and return 1; otherwise return 0 */
+.global spin_try
+.ent	spin_try
+.type	spin_try, @function
+spin_try:
+  .set mips2
+1:
+  ll $8, 0($4)
+  move $2, $0
+  bnez $8, 2f       /* someone else holds it, so give up */
+  li $2, 1
+  move $8, $2
+  sc $8, 0($4)
+  beqz $8, 1b       /* lost a race with some other write, so look again */
+2:
+  .set mips1
+  jr $ra
+.end	spin_try
+
+/* void spin_release(volatile unsigned int *word)
+ * set *word back to 0 */
+.global spin_release
+.ent	spin_release
+.type	spin_release, @function
+spin_release:
+  sw $0, 0($4)
+  jr $ra
+.end	spin_release
+
+/* unsigned int ticket_acquire(struct ticketlock *lock)
+ * take the next ticket, then wait until it is being served; returns the number
+ * of times it checked and found some other ticket being served */
+.global ticket_acquire
+.ent	ticket_acquire
+.type	ticket_acquire, @function
+ticket_acquire:
+  .set mips2
+1:
+  ll $8, 0($4)      /* r8 = my ticket = lock->next */
+  addiu $9, $8, 1
+  sc $9, 0($4)      /* lock->next = my ticket + 1 */
+  beqz $9, 1b
+  .set mips1
+  move $2, $0       /* r2 = count of failed checks */
+  b 3f
+2:
+  addiu $2, $2, 1
+3:
+  lw $9, 4($4)      /* r9 = lock->serving */
+  bne $9, $8, 2b    /* not my turn yet */
+  jr $ra
+.end	ticket_acquire
+
+/* void ticket_release(struct ticketlock *lock)
+ * serve the next ticket; only the holder ever writes lock->serving */
+.global ticket_release
+.ent	ticket_release
+.type	ticket_release, @function
+ticket_release:
+  lw $8, 4($4)
+  addiu $8, $8, 1
+  sw $8, 4($4)
+  jr $ra
+.end	ticket_release
+
+/* atomic operations (see sync.h) */
+
+/* unsigned int atomic_swap(volatile unsigned int *p, unsigned int v)
+ * set *p to v, and return the old value */
+.global atomic_swap
+.ent	atomic_swap
+.type	atomic_swap, @function
+atomic_swap:
+  .set mips2
+1:
+  ll $2, 0($4)      /* r2 = old value */
+  move $8, $5
+  sc $8, 0($4)      /* *p = v, unless someone wrote it since the ll */
+  beqz $8, 1b
+  .set mips1
+  jr $ra
+.end	atomic_swap
+
+/* unsigned int atomic_cas(volatile unsigned int *p, unsigned int expected, unsigned int desired)
+ * if *p == expected, set *p to desired; either way, return the old value */
+.global atomic_cas
+.ent	atomic_cas
+.type	atomic_cas, @function
+atomic_cas:
+  .set mips2
+1:
+  ll $2, 0($4)      /* r2 = old value */
+  bne $2, $5, 2f    /* not what we expected, so leave it alone */
+  move $8, $6
+  sc $8, 0($4)      /* *p = desired, unless someone wrote it since the ll */
+  beqz $8, 1b
+2:
+  .set mips1
+  jr $ra
+.end	atomic_cas
+
+/* unsigned int atomic_fetch_add(volatile unsigned int *p, unsigned int n)
+ * add n to *p, and return the old value */
+.global atomic_fetch_add
+.ent	atomic_fetch_add
+.type	atomic_fetch_add, @function
+atomic_fetch_add:
+  .set mips2
+1:
+  ll $2, 0($4)      /* r2 = old value */
+  addu $8, $2, $5
+  sc $8, 0($4)      /* *p = old + n, unless someone wrote it since the ll */
+  beqz $8, 1b
+  .set mips1
+  jr $ra
+.end	atomic_fetch_add
+
+/* cooperative task switching (see task.c) */
+
+/* void task_switch(struct mips_core_data *save, struct mips_core_data *load)
+ * save the callee-saved registers into save, using the same layout as the
+ * trap handler, then load them from load and return to wherever load left off;
+ * the caller-saved registers don't need saving, since task_switch() is called
+ * like any other function */
+.global task_switch
+.ent	task_switch
+.type	task_switch, @function
+task_switch:
+  sw $16,  64($4)   /* s0-s7 */
+  sw $17,  68($4)
+  sw $18,  72($4)
+  sw $19,  76($4)
+  sw $20,  80($4)
+  sw $21,  84($4)
+  sw $22,  88($4)
+  sw $23,  92($4)
+  sw $28, 112($4)   /* gp */
+  sw $29, 116($4)   /* sp */
+  sw $30, 120($4)   /* fp */
+  sw $31, 124($4)   /* ra */
+  lw $16,  64($5)
+  lw $17,  68($5)
+  lw $18,  72($5)
+  lw $19,  76($5)
+  lw $20,  80($5)
+  lw $21,  84($5)
+  lw $22,  88($5)
+  lw $23,  92($5)
+  lw $28, 112($5)
+  lw $29, 116($5)
+  lw $30, 120($5)
+  lw $31, 124($5)
+  jr $ra
+.end	task_switch
+
+/* first code run by a new task: task_create() leaves the task pointer in s0
+ * and points ra here, so the first task_switch() into the task lands here */
+.global task_start
+.ent	task_start
+.type	task_start, @function
+task_start:
+  move $4, $16
+  j task_main
+.end	task_start
@@ -10,6 +10,18 @@ void *physical_to_virtual(unsigned int paddr)
   return (void *)(0xC0000000 + paddr);
 }
 
+// return a usable virtual address for this core's page directory
+static unsigned int *current_pagedir()
+{
+  unsigned int context = current_cpu_context();
+  unsigned int ppn = context >> 12;
+  if (ppn < ram_start_page || ppn >= ram_end_page) {
+    printf("context register seems to point to non-RAM\n");
+    return 0;
+  }
+  return physical_to_virtual(ppn << 12);
+}
+
 unsigned int virtual_to_physical(void *vptr)
 {
   // If the virtual address is of the form 0xC0000000 + N, then the physical
@@ -24,14 +36,9 @@ unsigned int virtual_to_physical(void *vptr)
   unsigned int pti = (vaddr >> 12) & 0x3ff;
   unsigned int off = vaddr & 0xfff;
 
-  unsigned int context = current_cpu_context();
-  unsigned int ppn = context >> 12;
-  if (ppn < ram_start_page || ppn >= ram_end_page) {
-    printf("context register seems to point to non-RAM\n");
+  unsigned int *pd = current_pagedir();
+  if (!pd)
     return NOPAGE;
-  }
-
-  unsigned int *pd = physical_to_virtual(ppn << 12);
   unsigned int pde = pd[pdi];
   if (!(pde & 0x1)) {
     printf("PDE is invalid for virtual address %p\n", vptr);
@@ -49,21 +56,222 @@ unsigned int virtual_to_physical(void *vptr)
 }
 
 // some useful memory helper routines
+//
+// These work a 32-bit word at a time wherever they can, unrolled eight words
+// (32 bytes) per loop iteration, with byte loops only for the unaligned head and
+// tail of each buffer. When source and destination are misaligned relative to
+// each other, memcpy() still does aligned word loads and stores, shifting each
+// pair of source words together (this is a little-endian machine).
+
+#define WORD_ALIGNED(p) (((unsigned int)(p) & 3) == 0)
+
 void *memset(void *s, unsigned int c, unsigned int len)
 {
   unsigned char *p = s;
-  for (int i = 0; i < len; i++)
-    p[i] = (unsigned char)c;
+  c &= 0xff;
+  // head: bytes until p is word aligned
+  while (len > 0 && !WORD_ALIGNED(p)) {
+    *p++ = c;
+    len--;
+  }
+  // body: whole words
+  unsigned int w = c | (c << 8) | (c << 16) | (c << 24);
+  unsigned int *wp = (unsigned int *)p;
+  while (len >= 32) {
+    wp[0] = w; wp[1] = w; wp[2] = w; wp[3] = w;
+    wp[4] = w; wp[5] = w; wp[6] = w; wp[7] = w;
+    wp += 8;
+    len -= 32;
+  }
+  while (len >= 4) {
+    *wp++ = w;
+    len -= 4;
+  }
+  // tail: leftover bytes
+  p = (unsigned char *)wp;
+  while (len > 0) {
+    *p++ = c;
+    len--;
+  }
   return s;
 }
 
+// copy forwards, a word at a time where possible
+static void copy_forward(unsigned char *d, const unsigned char *s, unsigned int len)
+{
+  // head: bytes until d is word aligned
+  while (len > 0 && !WORD_ALIGNED(d)) {
+    *d++ = *s++;
+    len--;
+  }
+  unsigned int *dw = (unsigned int *)d;
+  if (WORD_ALIGNED(s)) {
+    // both aligned: straight word copy
+    const unsigned int *sw = (const unsigned int *)s;
+    while (len >= 32) {
+      dw[0] = sw[0]; dw[1] = sw[1]; dw[2] = sw[2]; dw[3] = sw[3];
+      dw[4] = sw[4]; dw[5] = sw[5]; dw[6] = sw[6]; dw[7] = sw[7];
+      dw += 8;
+      sw += 8;
+      len -= 32;
+    }
+    while (len >= 4) {
+      *dw++ = *sw++;
+      len -= 4;
+    }
+    s = (const unsigned char *)sw;
+  } else if (len >= 4) {
+    // misaligned source: merge pairs of aligned source words; the last aligned
+    // word we load always contains at least one byte we need, so we never read
+    // past the end of the source buffer's last word
+    int off = (unsigned int)s & 3;
+    int rs = 8 * off, ls = 32 - rs;
+    const unsigned int *sw = (const unsigned int *)(s - off);
+    unsigned int lo = *sw++;
+    while (len >= 4) {
+      unsigned int hi = *sw++;
+      *dw++ = (lo >> rs) | (hi << ls);
+      lo = hi;
+      len -= 4;
+      s += 4;
+    }
+  }
+  // tail: leftover bytes
+  d = (unsigned char *)dw;
+  while (len > 0) {
+    *d++ = *s++;
+    len--;
+  }
+}
+
 void *memcpy(void *dest, const void *src, unsigned int len)
+{
+  copy_forward(dest, src, len);
+  return dest;
+}
+
+void *memmove(void *dest, const void *src, unsigned int len)
 {
   unsigned char *d = dest;
   const unsigned char *s = src;
+  if (d <= s || d >= s + len) {
+    // no overlap, or dest is below src: copying forwards is safe
+    copy_forward(d, s, len);
+    return dest;
+  }
+  // dest overlaps the end of src, so copy backwards
+  d += len;
+  s += len;
+  if (((unsigned int)d & 3) == ((unsigned int)s & 3)) {
+    while (len > 0 && !WORD_ALIGNED(d)) {
+      *--d = *--s;
+      len--;
+    }
+    unsigned int *dw = (unsigned int *)d;
+    const unsigned int *sw = (const unsigned int *)s;
+    while (len >= 32) {
+      dw -= 8;
+      sw -= 8;
+      dw[7] = sw[7]; dw[6] = sw[6]; dw[5] = sw[5]; dw[4] = sw[4];
+      dw[3] = sw[3]; dw[2] = sw[2]; dw[1] = sw[1]; dw[0] = sw[0];
+      len -= 32;
+    }
+    while (len >= 4) {
+      *--dw = *--sw;
+      len -= 4;
+    }
+    d = (unsigned char *)dw;
+    s = (const unsigned char *)sw;
+  }
+  while (len > 0) {
+    *--d = *--s;
+    len--;
+  }
+  return dest;
+}
+
+int memcmp(const void *a, const void *b, unsigned int len)
+{
+  const unsigned char *p = a, *q = b;
+  if (((unsigned int)p & 3) == ((unsigned int)q & 3)) {
+    while (len > 0 && !WORD_ALIGNED(p)) {
+      if (*p != *q)
+	return *p - *q;
+      p++;
+      q++;
+      len--;
+    }
+    // skip over equal words; the byte loop below finds the difference, if any
+    const unsigned int *pw = (const unsigned int *)p, *qw = (const unsigned int *)q;
+    while (len >= 4 && *pw == *qw) {
+      pw++;
+      qw++;
+      len -= 4;
+    }
+    p = (const unsigned char *)pw;
+    q = (const unsigned char *)qw;
+  }
+  for (; len > 0; p++, q++, len--) {
+    if (*p != *q)
+      return *p - *q;
+  }
+  return 0;
+}
+
+// Measure the above routines, in cycles, for sizes from 8 bytes up to the
+// largest network packet, on aligned buffers, misaligned buffers, and
+// overlapping buffers. For comparison, it also measures a plain byte-at-a-time
+// copy loop, which is how memcpy() used to work.
+static void byte_copy(unsigned char *d, const unsigned char *s, unsigned int len)
+{
   for (int i = 0; i < len; i++)
     d[i] = s[i];
-  return dest;
+}
+
+void mem_benchmark()
+{
+  // each buffer gets a page, with room for misalignment and overlap
+  unsigned char *a = alloc_pages(1);
+  unsigned char *b = alloc_pages(1);
+  const int reps = 8;
+  printf("mem_benchmark: average cycles per call, over %d calls\n", reps);
+  printf("%6s %8s %8s %8s %8s %8s %8s\n",
+      "size", "bytecpy", "memset", "memcpy", "memcpy+1", "memmove", "memcmp");
+  for (unsigned int len = 8; ; len *= 2) {
+    if (len > NET_MAXPKT)
+      len = NET_MAXPKT; // finish with exactly the largest packet size
+    unsigned int t[6] = { 0 };
+    for (int r = 0; r < reps; r++) {
+      unsigned int t0 = current_cpu_cycles();
+      byte_copy(b, a, len);
+      unsigned int t1 = current_cpu_cycles();
+      memset(a, r, len);
+      unsigned int t2 = current_cpu_cycles();
+      memcpy(b, a, len);
+      unsigned int t3 = current_cpu_cycles();
+      memcpy(b, a + 1, len);
+      unsigned int t4 = current_cpu_cycles();
+      memmove(a + 3, a, len);
+      unsigned int t5 = current_cpu_cycles();
+      memcmp(a, a + 3, len);
+      unsigned int t6 = current_cpu_cycles();
+      t[0] += t1 - t0; t[1] += t2 - t1; t[2] += t3 - t2;
+      t[3] += t4 - t3; t[4] += t5 - t4; t[5] += t6 - t5;
+    }
+    printf("%6d %8d %8d %8d %8d %8d %8d\n", len,
+	t[0]/reps, t[1]/reps, t[2]/reps, t[3]/reps, t[4]/reps, t[5]/reps);
+    // sanity check the results, since nothing else tests these
+    for (int i = 0; i < len; i++)
+      a[i] = i * 7;
+    memcpy(b, a + 1, len - 1);
+    memmove(a + 1, a, len - 1);
+    if (memcmp(b, a + 2, len - 2) != 0 || memcmp(a + 1, b, 1) == 0)
+      printf("mem_benchmark: MISMATCH at size %d\n", len);
+    if (len == NET_MAXPKT)
+      break;
+  }
+  free_pages(a, 1);
+  free_pages(b, 1);
 }
 
 
@@ -79,16 +287,218 @@ static int bitmap_get(unsigned char *bitmap, int i) {
   return (bitmap[i/8] >> (i % 8)) & 0x1;
 }
 
+// find count clear bits in a row, searching a bitmap of nbits bits starting
+// near hint; returns the index of the first bit, or -1 if there is no such run
+static int bitmap_find_run(unsigned char *bitmap, int nbits, int hint, int count)
+{
+  int seen = 0;
+  for (int i = 0; i < nbits; i++) {
+    int end = (hint + i) % nbits;
+    if (end == 0)
+      seen = 0; // just wrapped around to the start of the bitmap
+    if (bitmap_get(bitmap, end) == 0)
+      seen++;
+    else
+      seen = 0;
+    if (seen == count)
+      return end - count + 1;
+  }
+  return -1;
+}
+
+// The following keeps statistics about the allocators, for mem_print_stats().
+//
+// Counters of free and used pages are protected by page_alloc_lock, so they are
+// exact. Other counters are only approximate when several cores update them at
+// once, which is good enough for statistics. Cycle costs are sampled: only
+// one out of every MEM_STATS_SAMPLE calls to each function gets timed, which
+// keeps the cost of reading the cycle counter out of the common case. The
+// timing totals of each function are updated together under a seqlock, so
+// cost_print() sees a matching sum, count, and max (and no torn 64-bit sum).
+
+#define MEM_STATS_SAMPLE 64
+
+struct cost_stats {
+  char *name;
+  unsigned int calls; // total calls
+  struct seqlock lock; // protects the fields below
+  unsigned int samples; // calls that were timed
+  unsigned long long cycles; // total cycles over all timed calls
+  unsigned int max; // most cycles taken by any single timed call
+};
+
+static struct cost_stats malloc_cost = { "malloc" };
+static struct cost_stats free_cost = { "free" };
+static struct cost_stats alloc_pages_cost = { "alloc_pages" };
+
+static unsigned int pages_free; // pages currently clear in page_alloc_bitmap
+static unsigned int page_alloc_failures; // requests that found no free run
+static unsigned int bigblock_pages; // pages used by large malloc() blocks
+static unsigned int vmalloc_pages; // pages currently mapped by vmap_alloc()
+
+// start timing a call, if this is one of the sampled calls; returns the cycle
+// counter to pass to cost_end(), or 0 if this call is not being timed
+static unsigned int cost_begin(struct cost_stats *c)
+{
+  if (c->calls++ % MEM_STATS_SAMPLE != 0)
+    return 0;
+  unsigned int t0 = current_cpu_cycles();
+  return t0 ? t0 : 1;
+}
+
+static void cost_end(struct cost_stats *c, unsigned int t0)
+{
+  if (!t0)
+    return;
+  unsigned int t = current_cpu_cycles() - t0;
+  seq_write_lock(&c->lock);
+  c->samples++;
+  c->cycles += t;
+  if (t > c->max)
+    c->max = t;
+  seq_write_unlock(&c->lock);
+}
+
+static void cost_print(struct cost_stats *c)
+{
+  unsigned int samples, max, seq;
+  unsigned long long cycles;
+  do {
+    seq = seq_read_begin(&c->lock);
+    samples = c->samples;
+    cycles = c->cycles;
+    max = c->max;
+  } while (seq_read_retry(&c->lock, seq));
+  unsigned int avg = samples ? (unsigned int)(cycles / samples) : 0;
+  printf("  %-12s %10u calls, %8u cycles avg, %8u cycles max (%u sampled)\n",
+      c->name, c->calls, avg, max, samples);
+}
+
+// The following is a simple allocator for DMA memory.
+//
+// Devices need the physical addresses of the buffers they read and write, and
+// some of those (e.g. a ring of dma_ring_slot entries) must be physically
+// contiguous. So at boot, right after the page allocator's bitmap, we set aside
+// one physically contiguous region of RAM just for DMA, and never let
+// alloc_pages() hand it out. Its size defaults to DMA_DEFAULT_PAGES, and can be
+// changed with a "dmapages=N" boot parameter.
+//
+// Like all of RAM, the region is mapped at 0xC0000000 plus its physical
+// address, so translating between virtual and physical addresses of DMA memory
+// is just adding or subtracting DMA_VIRT_OFFSET (see dma_to_physical() and
+// physical_to_dma() in kernel.h). DMA memory is handed out in whole pages,
+// tracked with a bitmap just like the page allocator.
+
+#define DMA_DEFAULT_PAGES 256 // 1 MB
+#define DMA_MAX_PAGES 8192 // 32 MB
+
+static struct spinlock dma_lock;
+static unsigned char dma_bitmap[DMA_MAX_PAGES / 8];
+static void *dma_base; // virtual address of the region
+static unsigned int dma_pages; // size of the region, in pages
+static unsigned int dma_hint;
+static unsigned int dma_pages_used;
+
+// set aside the DMA region starting at physical page ppn, with up to avail
+// pages available for it
+static void dma_init(unsigned int ppn, unsigned int avail)
+{
+  dma_pages = bootparam_int("dmapages", DMA_DEFAULT_PAGES);
+  if (dma_pages > DMA_MAX_PAGES)
+    dma_pages = DMA_MAX_PAGES;
+  if (dma_pages > avail / 2)
+    dma_pages = avail / 2; // leave something for everyone else
+  dma_base = physical_to_virtual(ppn << 12);
+  dma_hint = 0;
+}
+
+void *dma_alloc(unsigned int count)
+{
+  int level = intr_disable();
+  spin_lock(&dma_lock);
+  int start = -1;
+  if (count > 0 && count <= dma_pages)
+    start = bitmap_find_run(dma_bitmap, dma_pages, dma_hint, count);
+  if (start >= 0) {
+    for (int i = start; i < start + count; i++)
+      bitmap_set(dma_bitmap, i, 1);
+    dma_hint = (start + count) % dma_pages;
+    dma_pages_used += count;
+  }
+  spin_unlock(&dma_lock);
+  intr_restore(level);
+  if (start < 0) {
+    printf("dma_alloc: can't allocate %d pages (%d of %d DMA pages in use)\n",
+	count, dma_pages_used, dma_pages);
+    shutdown();
+  }
+  return dma_base + start * PAGE_SIZE;
+}
+
+void dma_free(void *page, unsigned int count)
+{
+  int start = (page - dma_base) / PAGE_SIZE;
+  if (page < dma_base || page != dma_base + start * PAGE_SIZE || start + count > dma_pages) {
+    printf("dma_free: virtual address %p did not come from dma_alloc\n", page);
+    shutdown();
+  }
+  int level = intr_disable();
+  spin_lock(&dma_lock);
+  for (int i = start; i < start + count; i++) {
+    if (bitmap_get(dma_bitmap, i) == 0) {
+      printf("dma_free: virtual address %p is already free\n", page);
+      shutdown();
+    }
+    bitmap_set(dma_bitmap, i, 0);
+  }
+  dma_pages_used -= count;
+  spin_unlock(&dma_lock);
+  intr_restore(level);
+}
+
 // The following is very simple page allocator.
 //
 // It can only allocate or free whole RAM pages at a time. It tracks which pages
 // are in use using a simple bitmap with 1 bit of state per page. It does not
 // attempt to track what each page allocation was for, or anything more
 // sophisticated than a single "free/busy" bit. It only works for RAM pages.
+//
+// The bitmap and hint are protected by page_alloc_lock, with interrupts
+// disabled while it is held, so any core can allocate and free pages.
+//
+// Most requests are for a single page (smallblock pages, packet buffers, etc.),
+// so to keep cores from all fighting over page_alloc_lock, each core keeps a
+// small cache of free pages in front of the bitmap. Single pages are allocated
+// from and freed to this core's cache, under a lock of its own that nobody else
+// normally touches. Only when the cache runs empty (or full) does the core take
+// page_alloc_lock, to move PAGE_CACHE_BATCH pages at once from (or back to) the
+// bitmap. Pages sitting in a cache are still marked busy in the bitmap, so
+// freeing a cached page a second time goes unnoticed until the page is drained
+// back to the bitmap.
+//
+// Since cached and pre-zeroed pages look busy, a request can fail while plenty
+// of pages are free. So before giving up, the allocator reclaims other cores'
+// caches back into the bitmap one at a time, trying again after each, and only
+// then the pool of pre-zeroed pages, stopping as soon as the request can be
+// met; that is what the per-cache locks are for. The lock order is a cache
+// lock, then page_alloc_lock. Growing an allocation in place never reclaims
+// anything, since the pages after it are far more likely to belong to some
+// other allocation than to be sitting in a cache.
+
+#define PAGE_CACHE_BATCH 16 // pages moved between a cache and the bitmap at a time
+#define PAGE_CACHE_MAX 64 // most pages a cache can hold
+
+struct page_cache {
+  struct spinlock lock; // only contended while reclaiming
+  unsigned int count;
+  void *pages[PAGE_CACHE_MAX];
+};
 
+static struct spinlock page_alloc_lock;
 static void *page_alloc_bitmap;
 static unsigned int page_alloc_hint;
 static unsigned int pages_reserved;
+static struct page_cache page_caches[MAX_CORES]; // one per core
 
 static void page_alloc_init()
 {
@@ -99,11 +509,119 @@ static void page_alloc_init()
   // ram_start_page, so we can just take the next n pages for our bitmap.
   page_alloc_bitmap = physical_to_virtual((ram_start_page + bootparams->bootpages) << 12);
   memset(page_alloc_bitmap, 0, n * PAGE_SIZE);
+  // the DMA region comes right after the bitmap
+  dma_init(ram_start_page + bootparams->bootpages + n, ram_pages - bootparams->bootpages - n);
   // we forbid anything lower than pages_reserved from ever being freed, so we
   // don't even keep it in the bitmap.
-  pages_reserved = bootparams->bootpages + n;
+  pages_reserved = bootparams->bootpages + n + dma_pages;
   // for allocation, start the search near page_alloc_hint
   page_alloc_hint = 0;
+  pages_free = ram_pages - pages_reserved;
+}
+
+// take count physically contiguous free pages from the bitmap, or return 0 if
+// there are none; page_alloc_lock must be held
+static void *page_alloc_run(unsigned int count)
+{
+  // look for count free pages in a row
+  int start = bitmap_find_run(page_alloc_bitmap, ram_pages - pages_reserved, page_alloc_hint, count);
+  if (start < 0)
+    return 0;
+  // start through end (inclusive) are all free
+  int end = start + count - 1;
+  for (int i = start; i <= end; i++)
+    bitmap_set(page_alloc_bitmap, i, 1);
+  page_alloc_hint = (end + 1) % (ram_pages - pages_reserved);
+  pages_free -= count;
+  return physical_to_virtual((ram_start_page + pages_reserved + start) << 12);
+}
+
+// give count pages, starting at physical page ppn, back to the bitmap;
+// page_alloc_lock must be held
+static void page_free_run(unsigned int ppn, unsigned int count)
+{
+  while (count > 0) {
+    int i = (ppn - ram_start_page - pages_reserved);
+    if (bitmap_get(page_alloc_bitmap, i) == 0) {
+      printf("free_pages: virtual address %p is already free\n", physical_to_virtual(ppn << 12));
+      shutdown();
+    }
+    bitmap_set(page_alloc_bitmap, i, 0);
+    pages_free++;
+    count--;
+    ppn++;
+  }
+}
+
+// move a batch of pages from the bitmap into an empty page cache; the cache's
+// lock must be held
+static void page_cache_refill(struct page_cache *pc)
+{
+  spin_lock(&page_alloc_lock);
+  while (pc->count < PAGE_CACHE_BATCH) {
+    void *page = page_alloc_run(1);
+    if (!page)
+      break;
+    pc->pages[pc->count++] = page;
+  }
+  spin_unlock(&page_alloc_lock);
+}
+
+// move a batch of pages from a full page cache back to the bitmap; the cache's
+// lock must be held
+static void page_cache_drain(struct page_cache *pc)
+{
+  spin_lock(&page_alloc_lock);
+  for (int i = 0; i < PAGE_CACHE_BATCH; i++)
+    page_free_run(virtual_to_physical(pc->pages[--pc->count]) / PAGE_SIZE, 1);
+  spin_unlock(&page_alloc_lock);
+}
+
+// take count physically contiguous free pages, without reclaiming anything, or
+// return 0 if there are none
+static void *page_alloc_try(unsigned int count)
+{
+  void *pages;
+  int level = intr_disable();
+  unsigned int t0 = cost_begin(&alloc_pages_cost);
+  if (count == 1) {
+    // common case: use this core's cache, refilling it first if needed
+    struct page_cache *pc = &page_caches[current_cpu_id()];
+    spin_lock(&pc->lock);
+    if (pc->count == 0)
+      page_cache_refill(pc);
+    pages = pc->count > 0 ? pc->pages[--pc->count] : 0;
+    spin_unlock(&pc->lock);
+  } else {
+    spin_lock(&page_alloc_lock);
+    pages = page_alloc_run(count);
+    spin_unlock(&page_alloc_lock);
+  }
+  cost_end(&alloc_pages_cost, t0);
+  intr_restore(level);
+  return pages;
+}
+
+static unsigned int page_cache_reclaim(int core);
+static unsigned int zeropool_reclaim();
+
+// like alloc_pages(), but returns 0 instead of giving up if there are not count
+// physically contiguous free pages
+static void *page_alloc_find(unsigned int count)
+{
+  if (count == 0 || count > ram_pages - pages_reserved) {
+    page_alloc_failures++;
+    return 0;
+  }
+  void *pages = page_alloc_try(count);
+  for (int c = 0; !pages && c < MAX_CORES; c++)
+    if (page_cache_reclaim(c) > 0)
+      pages = page_alloc_try(count);
+  if (!pages && zeropool_reclaim() > 0)
+    pages = page_alloc_try(count);
+  if (!pages)
+    page_alloc_failures++;
+  return pages;
 }
 
 void *alloc_pages(unsigned int count)
@@ -113,29 +631,125 @@ void *alloc_pages(unsigned int count)
 	count, ram_pages - pages_reserved);
     shutdown();
   }
-  // look for count free pages in a row
-  int seen = 0;
-  for (int i = 0; i < ram_pages - pages_reserved; i++) {
-    int end = (page_alloc_hint + i) % (ram_pages - pages_reserved);
-    if (end == 0)
-      seen = 0; // just wrapped around to the start of the bitmap
-    if (bitmap_get(page_alloc_bitmap, end) == 0)
-      seen++;
-    if (seen == count) {
-      int start = end - count + 1;
-      // start through end (inclusive) are all free
-      for (i = start; i <= end; i++)
-	bitmap_set(page_alloc_bitmap, i, 1);
-      page_alloc_hint = (end + 1) % (ram_pages - pages_reserved);
-      return physical_to_virtual((ram_start_page + pages_reserved + start) << 12);
-    }
+  void *pages = page_alloc_find(count);
+  if (!pages) {
+    printf("alloc_pages: no free pages left, sorry\n");
+    mem_print_stats();
+    shutdown();
   }
-  printf("alloc_pages: no free pages left, sorry\n");
-  shutdown();
+  return pages;
+}
+
+// The following is a pool of pre-zeroed pages.
+//
+// Zeroing a page with memset() is by far the most expensive part of
+// calloc_pages() and large calloc() calls. So instead, cores with nothing
+// better to do call mem_idle(), which zeroes free pages ahead of time and keeps
+// them in this pool, and the allocators take pages from the pool when they
+// need zeroed memory. The pool is a linked list threaded through the first
+// word of each page, which gets cleared again when the page leaves the pool.
+
+#define ZEROPOOL_TARGET 128 // number of zeroed pages idle cores try to keep ready
+
+static struct spinlock zeropool_lock;
+static void *zeropool_head;
+static volatile unsigned int zeropool_count;
+
+// take count zeroed pages from the pool and chain them together through their
+// first words, or return 0 if the pool doesn't have that many
+static void *zeropool_take(unsigned int count)
+{
+  void *first = 0;
+  int level = intr_disable();
+  spin_lock(&zeropool_lock);
+  if (count <= zeropool_count) {
+    first = zeropool_head;
+    void *last = first;
+    for (int i = 1; i < count; i++)
+      last = *(void **)last;
+    zeropool_head = *(void **)last;
+    *(void **)last = 0;
+    zeropool_count -= count;
+  }
+  spin_unlock(&zeropool_lock);
+  intr_restore(level);
+  return first;
+}
+
+// take one zeroed page from the pool, or return 0 if the pool is empty
+static void *zeropool_get()
+{
+  void *page = zeropool_take(1);
+  if (page)
+    *(void **)page = 0;
+  return page;
+}
+
+int mem_idle()
+{
+  if (zeropool_count >= ZEROPOOL_TARGET)
+    return 0;
+  void *page = page_alloc_try(1); // reclaiming would just undo our own work
+  if (!page)
+    return 0;
+  memset(page, 0, PAGE_SIZE);
+  int level = intr_disable();
+  spin_lock(&zeropool_lock);
+  *(void **)page = zeropool_head;
+  zeropool_head = page;
+  zeropool_count++;
+  spin_unlock(&zeropool_lock);
+  intr_restore(level);
+  return 1;
+}
+
+// give every page in a core's cache back to the bitmap; returns the number of
+// pages reclaimed
+static unsigned int page_cache_reclaim(int core)
+{
+  struct page_cache *pc = &page_caches[core];
+  int level = intr_disable();
+  spin_lock(&pc->lock);
+  spin_lock(&page_alloc_lock);
+  unsigned int reclaimed = pc->count;
+  while (pc->count > 0)
+    page_free_run(virtual_to_physical(pc->pages[--pc->count]) / PAGE_SIZE, 1);
+  spin_unlock(&page_alloc_lock);
+  spin_unlock(&pc->lock);
+  intr_restore(level);
+  return reclaimed;
+}
+
+// give every page in the pool of pre-zeroed pages back to the bitmap; returns
+// the number of pages reclaimed
+static unsigned int zeropool_reclaim()
+{
+  int level = intr_disable();
+  spin_lock(&zeropool_lock);
+  void *page = zeropool_head;
+  unsigned int reclaimed = zeropool_count;
+  zeropool_head = 0;
+  zeropool_count = 0;
+  spin_unlock(&zeropool_lock);
+  spin_lock(&page_alloc_lock);
+  while (page) {
+    void *next = *(void **)page;
+    page_free_run(virtual_to_physical(page) / PAGE_SIZE, 1);
+    page = next;
+  }
+  spin_unlock(&page_alloc_lock);
+  intr_restore(level);
+  return reclaimed;
 }
 
 void *calloc_pages(unsigned int count)
 {
+  if (count == 1) {
+    // common case: use a page that was zeroed ahead of time, if there is one
+    void *page = zeropool_get();
+    if (page)
+      return page;
+  }
   void *pages = alloc_pages(count);
   memset(pages, 0, count * PAGE_SIZE);
   return pages;
@@ -167,17 +781,250 @@ void free_pages(void *page, unsigned int count)
     printf("free_pages: virtual address %p is reserved and should never be freed\n", page);
     shutdown();
   }
-  while (count > 0) {
-    int i = (ppn - ram_start_page - pages_reserved);
-    if (bitmap_get(page_alloc_bitmap, i) == 0) {
-      printf("free_pages: virtual address %p is already free\n", page);
+  int level = intr_disable();
+  if (count == 1) {
+    // common case: keep the page in this core's cache, making room first if needed
+    struct page_cache *pc = &page_caches[current_cpu_id()];
+    spin_lock(&pc->lock);
+    if (pc->count == PAGE_CACHE_MAX)
+      page_cache_drain(pc);
+    pc->pages[pc->count++] = page;
+    spin_unlock(&pc->lock);
+  } else {
+    spin_lock(&page_alloc_lock);
+    page_free_run(ppn, count);
+    spin_unlock(&page_alloc_lock);
+  }
+  intr_restore(level);
+}
+
+// try to grow a run of count pages from alloc_pages() in place, by taking the
+// extra pages that immediately follow it; returns 1 on success, or 0 (having
+// changed nothing) if any of those pages is busy or doesn't exist
+static int page_alloc_extend(void *page, unsigned int count, unsigned int extra)
+{
+  int i = virtual_to_physical(page) / PAGE_SIZE - ram_start_page - pages_reserved + count;
+  if (i + extra > ram_pages - pages_reserved)
+    return 0;
+  int ok = 1;
+  int level = intr_disable();
+  spin_lock(&page_alloc_lock);
+  for (int k = i; k < i + extra; k++) {
+    if (bitmap_get(page_alloc_bitmap, k)) {
+      ok = 0;
+      break;
+    }
+  }
+  if (ok) {
+    for (int k = i; k < i + extra; k++)
+      bitmap_set(page_alloc_bitmap, k, 1);
+    pages_free -= extra;
+  }
+  spin_unlock(&page_alloc_lock);
+  intr_restore(level);
+  return ok;
+}
+
+// The following is a simple allocator for virtually contiguous memory.
+//
+// It hands out runs of virtual pages from a reserved region of the kernel
+// virtual address space, below the 0xC0000000 mapping of physical memory, and
+// backs each virtual page with an individually allocated physical page. This
+// way, a request for 100 pages succeeds so long as there are 100 free pages
+// anywhere in RAM, even if no 100 of them are physically contiguous.
+//
+// To keep things simple, all of the page tables covering the region are
+// allocated up front, and their PDEs are installed in the page directory that
+// the Context register points to when vmalloc_init() runs. After that, mapping
+// and unmapping pages only ever touches PTEs, so any core that shares those
+// page tables sees the same mappings. The simulator has no TLB, so there is
+// nothing to flush after changing a PTE.
+//
+// The bitmap, hint and vmalloc_pages are protected by vmalloc_lock, with
+// interrupts disabled while it is held. A run of virtual pages is marked busy
+// in the bitmap before any of its PTEs are written, and only marked free again
+// after they have all been cleared, so no two cores ever map the same pages.
+
+#define VMALLOC_START 0xA0000000 // start of reserved virtual region
+#define VMALLOC_SIZE (128*1024*1024) // 128 MB of virtual address space
+#define VMALLOC_PAGES (VMALLOC_SIZE / PAGE_SIZE)
+#define VMALLOC_PTS (VMALLOC_PAGES / 1024) // each page table covers 1024 pages
+
+#define PTE_V 0x1 // valid
+#define PTE_W 0x2 // writable
+
+static struct spinlock vmalloc_lock;
+static unsigned char *vmalloc_bitmap; // 1 bit per virtual page, or 0 if the region is unusable
+static unsigned int vmalloc_hint;
+static unsigned int *vmalloc_pt[VMALLOC_PTS]; // page tables covering the region
+
+static void vmalloc_init()
+{
+  unsigned int *pd = current_pagedir();
+  if (!pd)
+    return;
+  // make sure nothing else (e.g. the boot stacks) lives in our region
+  for (int i = 0; i < VMALLOC_PTS; i++) {
+    if (pd[(VMALLOC_START >> 22) + i] & 0x1) {
+      printf("vmalloc: virtual address %p is already in use, disabling vmalloc\n",
+	  (void *)(VMALLOC_START + i * 1024 * PAGE_SIZE));
+      return;
+    }
+  }
+  for (int i = 0; i < VMALLOC_PTS; i++) {
+    vmalloc_pt[i] = calloc_pages(1);
+    pd[(VMALLOC_START >> 22) + i] = virtual_to_physical(vmalloc_pt[i]) | 0x1;
+  }
+  vmalloc_bitmap = calloc_pages((VMALLOC_PAGES / 8 + PAGE_SIZE - 1) / PAGE_SIZE);
+  vmalloc_hint = 0;
+}
+
+static int is_vmalloc_addr(void *vptr)
+{
+  return vptr >= (void *)VMALLOC_START && vptr < (void *)(VMALLOC_START + VMALLOC_SIZE);
+}
+
+static unsigned int *vmalloc_pte(int i)
+{
+  return &vmalloc_pt[i / 1024][i % 1024];
+}
+
+// undo the first count mappings of a run of virtual pages starting at index start
+static void vmap_release(int start, unsigned int count)
+{
+  for (int i = start; i < start + count; i++) {
+    unsigned int *pte = vmalloc_pte(i);
+    free_pages(physical_to_virtual(*pte & ~0xFFF), 1);
+    *pte = 0;
+  }
+}
+
+// mark count virtual pages starting at index start as free again
+static void vmap_unreserve(int start, unsigned int count)
+{
+  int level = intr_disable();
+  spin_lock(&vmalloc_lock);
+  for (int i = start; i < start + count; i++)
+    bitmap_set(vmalloc_bitmap, i, 0);
+  spin_unlock(&vmalloc_lock);
+  intr_restore(level);
+}
+
+// map count individual physical pages at virtually contiguous addresses, or
+// return 0 if there is not enough virtual space or not enough RAM; if zeroed is
+// nonzero, the pages all come from the pool of pre-zeroed pages
+static void *vmap_alloc(unsigned int count, int zeroed)
+{
+  if (!vmalloc_bitmap || count == 0 || count > VMALLOC_PAGES)
+    return 0;
+  // reserve the virtual pages first, so no other core can map them too
+  int level = intr_disable();
+  spin_lock(&vmalloc_lock);
+  int start = bitmap_find_run(vmalloc_bitmap, VMALLOC_PAGES, vmalloc_hint, count);
+  if (start >= 0) {
+    for (int i = start; i < start + count; i++)
+      bitmap_set(vmalloc_bitmap, i, 1);
+    vmalloc_hint = (start + count) % VMALLOC_PAGES;
+  }
+  spin_unlock(&vmalloc_lock);
+  intr_restore(level);
+  if (start < 0)
+    return 0;
+  void *chain = 0;
+  if (zeroed) {
+    chain = zeropool_take(count);
+    if (!chain) {
+      vmap_unreserve(start, count);
+      return 0;
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    void *page;
+    if (zeroed) {
+      page = chain;
+      chain = *(void **)page;
+      *(void **)page = 0;
+    } else {
+      page = page_alloc_find(1);
+      if (!page) {
+	vmap_release(start, i);
+	vmap_unreserve(start, count);
+	return 0;
+      }
+    }
+    *vmalloc_pte(start + i) = virtual_to_physical(page) | PTE_W | PTE_V;
+  }
+  level = intr_disable();
+  spin_lock(&vmalloc_lock);
+  vmalloc_pages += count;
+  spin_unlock(&vmalloc_lock);
+  intr_restore(level);
+  return (void *)(VMALLOC_START + start * PAGE_SIZE);
+}
+
+// unmap count pages that came from vmap_alloc(), and free the underlying RAM
+static void vmap_free(void *vptr, unsigned int count)
+{
+  int start = ((unsigned int)vptr - VMALLOC_START) / PAGE_SIZE;
+  if (((unsigned int)vptr & 0xfff) || start + count > VMALLOC_PAGES) {
+    printf("vmap_free: virtual address %p did not come from vmalloc\n", vptr);
+    shutdown();
+  }
+  int level = intr_disable();
+  spin_lock(&vmalloc_lock);
+  for (int i = start; i < start + count; i++) {
+    if (bitmap_get(vmalloc_bitmap, i) == 0) {
+      printf("vmap_free: virtual address %p is already free\n", vptr);
       shutdown();
     }
-    bitmap_set(page_alloc_bitmap, i, 0);
-    count--;
-    page += PAGE_SIZE;
-    ppn++;
   }
+  vmalloc_pages -= count;
+  spin_unlock(&vmalloc_lock);
+  intr_restore(level);
+  vmap_release(start, count);
+  vmap_unreserve(start, count);
+}
+
+// try to grow a run of count pages from vmap_alloc() in place, by mapping extra
+// more pages right after it; returns 1 on success, or 0 (having changed
+// nothing) if those virtual pages are in use or there is not enough RAM
+static int vmap_extend(void *vptr, unsigned int count, unsigned int extra)
+{
+  int i = ((unsigned int)vptr - VMALLOC_START) / PAGE_SIZE + count;
+  if (i + extra > VMALLOC_PAGES)
+    return 0;
+  int ok = 1;
+  int level = intr_disable();
+  spin_lock(&vmalloc_lock);
+  for (int k = i; k < i + extra; k++) {
+    if (bitmap_get(vmalloc_bitmap, k)) {
+      ok = 0;
+      break;
+    }
+  }
+  if (ok) {
+    for (int k = i; k < i + extra; k++)
+      bitmap_set(vmalloc_bitmap, k, 1);
+  }
+  spin_unlock(&vmalloc_lock);
+  intr_restore(level);
+  if (!ok)
+    return 0;
+  for (int k = 0; k < extra; k++) {
+    void *page = page_alloc_find(1);
+    if (!page) {
+      vmap_release(i, k);
+      vmap_unreserve(i, extra);
+      return 0;
+    }
+    *vmalloc_pte(i + k) = virtual_to_physical(page) | PTE_W | PTE_V;
+  }
+  level = intr_disable();
+  spin_lock(&vmalloc_lock);
+  vmalloc_pages += extra;
+  spin_unlock(&vmalloc_lock);
+  intr_restore(level);
+  return 1;
 }
 
 // The following is fairly simple malloc implementation.
@@ -186,27 +1033,34 @@ void free_pages(void *page, unsigned int count)
 // upwards to make accounting simpler, as follows:
 //
 // For small allocations (half a page or less), it rounds up to the nearest
-// power of two, and groups allocations into buckets by size. For instance, all
-// allocations at least 65 bytes but no more than 128 bytes are all rounded up
-// to 128 bytes. The allocations are then packed into pages, e.g. for 128 byte
-// allocations, 16 allocations fit on a single page, minus accounting overhead.
+// blocksize, and groups allocations into buckets by size. The blocksizes are
+// the powers of two from 32 to 2048 bytes, plus the halfway points between them
+// (48, 96, 192, and so on), so no block is ever more than a third bigger than
+// needed. For instance, all allocations at least 65 bytes but no more than 96
+// bytes are all rounded up to 96 bytes. The allocations are then packed into
+// pages, e.g. for 96 byte allocations, 42 allocations fit on a single page,
+// after the accounting overhead. Finding the blocksize for a given size is a
+// single lookup in the size_to_blocksize[] table.
 //
 // For large allocations (more than half a page), it rounds up to the nearest
-// multiple of the page size and just uses alloc_pages(). This implementation
-// doesn't make any effort to deal with fragmentation. For instance,
-// alloc_pages(100) will fail if there are not 100 physically contiguous pages
-// available, even if there are plenty of individual pages available.  In
-// principle, we could use virtual memory to make 100 individual pages appear
-// virtually contiguous, but this implementation doesn't even try.
+// multiple of the page size and tries alloc_pages() first. If RAM is too
+// fragmented to find that many physically contiguous pages, it falls back to
+// vmap_alloc(), which uses virtual memory to make individual pages appear
+// virtually contiguous. Only when both fail does malloc() give up.
 
-#define MIN_BLOCKSIZE2 5   // 2^5 = 32 bytes
-#define MAX_BLOCKSIZE2 11  // 2^11 = 2048 bytes
+#define NUM_BLOCKSIZES 13
+static const unsigned int blocksizes[NUM_BLOCKSIZES] = {
+  32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+#define MAX_BLOCKSIZE 2048 // largest small allocation
+#define BLOCKSIZE_GRAIN 16 // every blocksize is a multiple of this
 
 // For the smallest possible allocation, 32 bytes, the page can hold at most
 // 4096/32 = 128 blocks. In this case, the bitmap needs 128/8 = 16 bytes, so the
-// smallblock_info will take up exactly 32 bytes, or one block. So in all cases, we
-// will reserve the first block (however big it happens to be) of each page for
-// the smallblock_info accounting data.
+// smallblock_info will take up exactly 32 bytes. So in all cases, we reserve the
+// first 32 bytes of each page for the smallblock_info accounting data, and
+// number the blocks starting right after that: block j starts at byte
+// 32 + j * blocksize of the page.
 struct smallblock_info {
   unsigned int magic; // 0xfeedface, for debugging and sanity checks
   unsigned int blocksize; // size of blocks on this page
@@ -215,97 +1069,362 @@ struct smallblock_info {
 };
 
 // For large allocations, there is no bitmap and no linked lists. We just keep
-// track of the number of pages, so that we can call free_pages() with the
-// proper argument.
+// track of the number of pages, so that we can call free_pages() (or
+// vmap_free(), for virtually contiguous blocks) with the proper argument.
 struct bigblock_info {
-  unsigned int magic; // 0xf00dface, for debugging and sanity checks
+  unsigned int magic; // 0xf00dface (or 0xfacef00d if from vmap_alloc), for debugging and sanity checks
   unsigned int pagecount;
 };
 
-#define NUM_BLOCKSIZES (MAX_BLOCKSIZE2 - MIN_BLOCKSIZE2 + 1) // 5 though 11 inclusive
 struct smallblock_info smallblock[NUM_BLOCKSIZES];
 
+// size_to_blocksize[(size + 15) / 16] is the index into smallblock[] for the
+// smallest blocksize that fits size bytes
+static unsigned char size_to_blocksize[MAX_BLOCKSIZE / BLOCKSIZE_GRAIN + 1];
+
+#define SMALLBLOCK_INDEX(size) (size_to_blocksize[((size) + BLOCKSIZE_GRAIN - 1) / BLOCKSIZE_GRAIN])
+#define SMALLBLOCK_PIECES(blocksize) ((PAGE_SIZE - sizeof(struct smallblock_info)) / (blocksize))
+#define SMALLBLOCK_PTR(elt, j) ((void *)(elt) + sizeof(struct smallblock_info) + (j) * (elt)->blocksize)
+
+// statistics for each blocksize
+struct smallblock_stats {
+  unsigned int live; // blocks currently allocated
+  unsigned int peak; // most blocks ever allocated at once
+  unsigned int pages; // pages holding blocks of this size
+  unsigned int allocs; // blocks ever allocated
+  unsigned long long requested; // bytes ever asked for in those allocations
+};
+static struct smallblock_stats smallblock_stats[NUM_BLOCKSIZES];
+
+static void smallblock_count(int i, int delta)
+{
+  smallblock_stats[i].live += delta;
+  if (smallblock_stats[i].live > smallblock_stats[i].peak)
+    smallblock_stats[i].peak = smallblock_stats[i].live;
+}
+
 static void malloc_init()
 {
   for (int i = 0; i < NUM_BLOCKSIZES; i++) {
     smallblock[i].next = smallblock[i].prev = &smallblock[i];
-    smallblock[i].blocksize = 1 << (MIN_BLOCKSIZE2+i);
+    smallblock[i].blocksize = blocksizes[i];
+  }
+  int i = 0;
+  for (int g = 0; g <= MAX_BLOCKSIZE / BLOCKSIZE_GRAIN; g++) {
+    while (blocksizes[i] < g * BLOCKSIZE_GRAIN)
+      i++;
+    size_to_blocksize[g] = i;
   }
 }
 
-void *malloc(unsigned int size)
+// fill in the accounting data at the start of a large block, and return the
+// pointer to the usable part of it
+static void *bigblock_init(void *p, unsigned int magic, unsigned int pagecount)
 {
-  // try small allocation first
-  for (int i = 0; i < NUM_BLOCKSIZES; i++) {
-    if (size <= smallblock[i].blocksize) {
-      struct smallblock_info *elt, *head = &smallblock[i];
-      int pieces_per_page = PAGE_SIZE / head->blocksize;
+  // first part of page is for accounting
+  struct bigblock_info *elt = p;
+  elt->magic = magic;
+  elt->pagecount = pagecount;
+  // remainder of page is the actual data
+  void *pointer = (p + sizeof(struct bigblock_info));
+  return pointer;
+}
 
-      // for each existing page of this blocksize
-      for (elt = head->next; elt != head; elt = elt->next) {
+// The following is an optional sampling heap profiler.
+//
+// When enabled with a "heapprof=N" boot parameter, every Nth call to malloc()
+// or calloc() on each core records the caller's return address, the size, and
+// the cycle counter in that core's ring of samples (one page, allocated the
+// first time it is needed). The ring overwrites its oldest samples, so it
+// always describes the most recent sampled allocations on that core. Nothing
+// is recorded on free(); instead, heap_profile_dump() checks whether each
+// sampled block is still allocated by looking at the allocator's own
+// accounting data, and adds up the live bytes by call site. That check can
+// mistake a block that was freed and then reallocated for the original one,
+// so treat the results as an estimate. The dump reads other cores' rings while
+// they may still be recording, which is fine for an estimate too.
 
-	// for each of the blocks on this page (note: block 0 is reserved)
-	for (int j = 1; j < pieces_per_page; j++) {
+struct heap_sample {
+  void *site; // return address of the malloc() or calloc() call
+  void *pointer; // the block that was allocated
+  unsigned int size; // bytes asked for
+  unsigned int cycles; // when it was allocated
+};
 
-	  // if the block is free
-	  if (bitmap_get(elt->bitmap, j) == 0) {
+#define HEAP_PROFILE_RING (PAGE_SIZE / sizeof(struct heap_sample))
+#define HEAP_PROFILE_SITES 32 // most call sites heap_profile_dump() will list
 
-	    // then use that block
-	    bitmap_set(elt->bitmap, j, 1);
-	    void *pointer = (void *)elt + j * elt->blocksize;
-	    return pointer;
+struct heap_profile {
+  unsigned int countdown; // allocations left until the next sample
+  unsigned int next; // total samples taken; next one goes at ring[next % HEAP_PROFILE_RING]
+  struct heap_sample *ring;
+};
+
+static unsigned int heap_profile_rate; // sample every Nth allocation, or 0 if off
+static struct heap_profile heap_profiles[MAX_CORES]; // one per core
+
+static void heap_profile(void *pointer, unsigned int size, void *site)
+{
+  if (!heap_profile_rate)
+    return;
+  struct heap_profile *hp = &heap_profiles[current_cpu_id()];
+  if (hp->countdown > 1) {
+    hp->countdown--;
+    return;
+  }
+  hp->countdown = heap_profile_rate;
+  if (!hp->ring)
+    hp->ring = alloc_pages(1);
+  struct heap_sample *sample = &hp->ring[hp->next % HEAP_PROFILE_RING];
+  sample->site = site;
+  sample->pointer = pointer;
+  sample->size = size;
+  sample->cycles = current_cpu_cycles();
+  hp->next++;
+}
+
+// check whether a block from malloc() still seems to be allocated
+static int heap_block_live(void *pointer)
+{
+  void *page = (void *)((unsigned int)pointer & ~(PAGE_SIZE-1));
+  if (is_vmalloc_addr(page)) {
+    // don't touch unmapped virtual pages
+    int i = ((unsigned int)page - VMALLOC_START) / PAGE_SIZE;
+    if (!bitmap_get(vmalloc_bitmap, i))
+      return 0;
+  }
+  unsigned int *magic = page;
+  if (*magic == 0xfeedface) {
+    struct smallblock_info *elt = page;
+    int idx = (pointer - SMALLBLOCK_PTR(elt, 0)) / (int)elt->blocksize;
+    return pointer == SMALLBLOCK_PTR(elt, idx) && bitmap_get(elt->bitmap, idx);
+  }
+  return *magic == 0xf00dface || *magic == 0xfacef00d;
+}
 
-	  }
+void heap_profile_dump()
+{
+  if (!heap_profile_rate) {
+    printf("heap profile: off (use the heapprof=N boot parameter to sample every Nth allocation)\n");
+    return;
+  }
+  struct {
+    void *site;
+    unsigned int samples; // live samples from this site
+    unsigned int bytes; // live bytes in those samples
+    unsigned int oldest; // cycle count of the oldest one
+  } sites[HEAP_PROFILE_SITES];
+  int nsites = 0, dropped = 0;
+  unsigned int total = 0;
+  for (int c = 0; c < MAX_CORES; c++) {
+    struct heap_profile *hp = &heap_profiles[c];
+    if (!hp->ring)
+      continue;
+    int n = hp->next < HEAP_PROFILE_RING ? hp->next : HEAP_PROFILE_RING;
+    for (int k = 0; k < n; k++) {
+      struct heap_sample *sample = &hp->ring[k];
+      if (!heap_block_live(sample->pointer))
+	continue;
+      int i;
+      for (i = 0; i < nsites && sites[i].site != sample->site; i++)
+	;
+      if (i == nsites) {
+	if (nsites == HEAP_PROFILE_SITES) {
+	  dropped++;
+	  continue;
 	}
+	sites[i].site = sample->site;
+	sites[i].samples = sites[i].bytes = 0;
+	sites[i].oldest = sample->cycles;
+	nsites++;
       }
+      sites[i].samples++;
+      sites[i].bytes += sample->size;
+      if ((int)(sample->cycles - sites[i].oldest) < 0)
+	sites[i].oldest = sample->cycles;
+      total += sample->size;
+    }
+  }
+  printf("heap profile: 1 in %u allocations sampled, about %u live bytes sampled in total\n",
+      heap_profile_rate, total * heap_profile_rate);
+  printf("  %10s %8s %12s %12s\n", "call site", "samples", "est. bytes", "oldest age");
+  unsigned int now = current_cpu_cycles();
+  for (int i = 0; i < nsites; i++)
+    printf("  %p %8u %12u %12u\n", sites[i].site, sites[i].samples,
+	sites[i].bytes * heap_profile_rate, now - sites[i].oldest);
+  if (dropped)
+    printf("  (%d samples from other call sites not shown)\n", dropped);
+}
 
-      // there were no existing pages with free blocks
-      void *p = alloc_pages(1);
-      // first part of page is for accounting
-      elt = p;
-      elt->magic = 0xfeedface;
-      elt->blocksize = head->blocksize;
-      memset(elt->bitmap, 0, 16);
-      // add to existing list
-      elt->next = head;
-      elt->prev = head->prev;
-      elt->next->prev = elt;
-      elt->prev->next = elt;
-      // remainder of block is the actual data
-      bitmap_set(elt->bitmap, 1, 1);
-      void *pointer = p + 1 * elt->blocksize;
-      return pointer;
+static void *do_malloc(unsigned int size)
+{
+  // try small allocation first
+  if (size <= MAX_BLOCKSIZE) {
+    int i = SMALLBLOCK_INDEX(size);
+    struct smallblock_info *elt, *head = &smallblock[i];
+    int pieces_per_page = SMALLBLOCK_PIECES(head->blocksize);
+    smallblock_stats[i].allocs++;
+    smallblock_stats[i].requested += size;
+
+    // for each existing page of this blocksize
+    for (elt = head->next; elt != head; elt = elt->next) {
+
+      // for each of the blocks on this page
+      for (int j = 0; j < pieces_per_page; j++) {
+
+	// if the block is free
+	if (bitmap_get(elt->bitmap, j) == 0) {
+
+	  // then use that block
+	  bitmap_set(elt->bitmap, j, 1);
+	  smallblock_count(i, +1);
+	  void *pointer = SMALLBLOCK_PTR(elt, j);
+	  return pointer;
+
+	}
+      }
     }
+
+    // there were no existing pages with free blocks
+    void *p = alloc_pages(1);
+    // first part of page is for accounting
+    elt = p;
+    elt->magic = 0xfeedface;
+    elt->blocksize = head->blocksize;
+    memset(elt->bitmap, 0, 16);
+    // add to existing list
+    elt->next = head;
+    elt->prev = head->prev;
+    elt->next->prev = elt;
+    elt->prev->next = elt;
+    // remainder of page is the actual data
+    bitmap_set(elt->bitmap, 0, 1);
+    smallblock_stats[i].pages++;
+    smallblock_count(i, +1);
+    void *pointer = SMALLBLOCK_PTR(elt, 0);
+    return pointer;
   }
 
   // resort to large allocation if it wasn't small
   size += sizeof(struct bigblock_info); // accounting overhead
   int n = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-  void *p = alloc_pages(n);
-  // first part of page is for accounting
-  struct bigblock_info *elt = p;
-  elt->magic = 0xf00dface;
-  elt->pagecount = n;
-  // remainder of page is the actual data
-  void *pointer = (p + sizeof(struct bigblock_info));
+  void *p = page_alloc_find(n);
+  if (p) {
+    bigblock_pages += n;
+    return bigblock_init(p, 0xf00dface, n);
+  }
+  // not enough contiguous RAM, so try to map scattered pages instead
+  return vmalloc(size - sizeof(struct bigblock_info));
+}
+
+void *malloc(unsigned int size)
+{
+  unsigned int t0 = cost_begin(&malloc_cost);
+  void *pointer = do_malloc(size);
+  cost_end(&malloc_cost, t0);
+  heap_profile(pointer, size, __builtin_return_address(0));
   return pointer;
 }
 
+void *vmalloc(unsigned int size)
+{
+  size += sizeof(struct bigblock_info); // accounting overhead
+  int n = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+  void *p = vmap_alloc(n, 0);
+  if (!p) {
+    printf("vmalloc: can't allocate %d pages, sorry\n", n);
+    mem_print_stats();
+    shutdown();
+  }
+  return bigblock_init(p, 0xfacef00d, n);
+}
+
 void *calloc(unsigned int size, unsigned int count)
 {
   // round size up to multiples of 4, for compatibility with standard code
   size = (size + 3) & ~3;
-  void *p = malloc(size * count);
-  memset(p, 0, size * count);
+  if (size * count > MAX_BLOCKSIZE) {
+    // large allocation: if there are enough pre-zeroed pages ready, map those
+    // instead of clearing fresh ones
+    int n = (size * count + sizeof(struct bigblock_info) + PAGE_SIZE - 1) / PAGE_SIZE;
+    void *p = vmap_alloc(n, 1);
+    if (p) {
+      p = bigblock_init(p, 0xfacef00d, n);
+      heap_profile(p, size * count, __builtin_return_address(0));
+      return p;
+    }
+  }
+  unsigned int t0 = cost_begin(&malloc_cost);
+  void *p = do_malloc(size * count);
+  cost_end(&malloc_cost, t0);
+  parallel_memset(p, 0, size * count);
+  heap_profile(p, size * count, __builtin_return_address(0));
   return p;
 }
 
-void free(void *pointer)
+void *realloc(void *pointer, unsigned int size)
+{
+  if (!pointer)
+    return malloc(size);
+  if (size == 0) {
+    free(pointer);
+    return 0;
+  }
+  void *page = (void *)((unsigned int)pointer & ~(PAGE_SIZE-1));
+  unsigned int *magic = page;
+  unsigned int oldsize; // usable bytes in the existing block
+  if (*magic == 0xfeedface) {
+    // small block: nothing to do if it is still big enough
+    struct smallblock_info *elt = page;
+    if (size <= elt->blocksize)
+      return pointer;
+    oldsize = elt->blocksize;
+  } else if (*magic == 0xf00dface || *magic == 0xfacef00d) {
+    // big block: shrink or grow the run of pages in place, if possible
+    struct bigblock_info *elt = page;
+    int vm = (*magic == 0xfacef00d);
+    unsigned int n = (size + sizeof(struct bigblock_info) + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (n <= elt->pagecount) {
+      // shrinking: give back the pages at the end
+      if (n < elt->pagecount && vm) {
+	vmap_free(page + n * PAGE_SIZE, elt->pagecount - n);
+      } else if (n < elt->pagecount) {
+	free_pages(page + n * PAGE_SIZE, elt->pagecount - n);
+	bigblock_pages -= elt->pagecount - n;
+      }
+      elt->pagecount = n;
+      return pointer;
+    }
+    // growing: take the pages right after the block, if they are free
+    unsigned int extra = n - elt->pagecount;
+    if (vm ? vmap_extend(page, elt->pagecount, extra) : page_alloc_extend(page, elt->pagecount, extra)) {
+      if (!vm)
+	bigblock_pages += extra;
+      elt->pagecount = n;
+      return pointer;
+    }
+    oldsize = elt->pagecount * PAGE_SIZE - sizeof(struct bigblock_info);
+  } else {
+    printf("realloc: virtual address %p has bad magic (0x%x), either didn't come from malloc, was freed, or is corrupted\n", pointer, *magic);
+    shutdown();
+  }
+
+  // last resort: copy to a new block
+  unsigned int t0 = cost_begin(&malloc_cost);
+  void *p = do_malloc(size);
+  cost_end(&malloc_cost, t0);
+  heap_profile(p, size, __builtin_return_address(0));
+  parallel_memcpy(p, pointer, oldsize < size ? oldsize : size);
+  free(pointer);
+  return p;
+}
+
+static void do_free(void *pointer)
 {
   // round down to nearest page boundary
   void *page = (void *)((unsigned int)pointer & ~(PAGE_SIZE-1));
   // some trivial sanity checks 
-  if (page < (void *)0xC0000000) {
+  if (page < (void *)0xC0000000 && !is_vmalloc_addr(page)) {
     printf("free: virtual address %p is too low to have come from malloc\n", pointer);
     shutdown();
   }
@@ -320,8 +1439,8 @@ void free(void *pointer)
     // small block
     struct smallblock_info *elt = page;
     // calculate index into blocks of page
-    int idx = (pointer - page) / elt->blocksize;
-    if (idx < 1 || pointer != (page + idx * elt->blocksize)) {
+    int idx = (pointer - SMALLBLOCK_PTR(elt, 0)) / (int)elt->blocksize;
+    if (pointer < SMALLBLOCK_PTR(elt, 0) || pointer != SMALLBLOCK_PTR(elt, idx)) {
       printf("free: virtual address %p is not aligned properly to have come from malloc\n", pointer);
       shutdown();
     }
@@ -330,19 +1449,93 @@ void free(void *pointer)
       shutdown();
     }
     bitmap_set(elt->bitmap, idx, 0);
+    smallblock_count(SMALLBLOCK_INDEX(elt->blocksize), -1);
     // we could, if we want, free the whole page if all the blocks on the page
     // are empty, but we won't bother
   } else if (*magic == 0xf00dface) {
     // big block
     struct bigblock_info *elt = page;
     elt->magic = 0xdeadf00d; // erase the magic number
+    bigblock_pages -= elt->pagecount;
     free_pages(page, elt->pagecount);
+  } else if (*magic == 0xfacef00d) {
+    // big block, virtually contiguous
+    struct bigblock_info *elt = page;
+    elt->magic = 0xdeadf00d; // erase the magic number
+    vmap_free(page, elt->pagecount);
   } else {
     printf("free: virtual address %p has bad magic (0x%x), either didn't come from malloc, was freed, or is corrupted\n", pointer, *magic);
     shutdown();
   }
 }
 
+void free(void *pointer)
+{
+  unsigned int t0 = cost_begin(&free_cost);
+  do_free(pointer);
+  cost_end(&free_cost, t0);
+}
+
+void mem_print_stats()
+{
+  // Internal fragmentation is the fraction of each block that was not asked
+  // for. To see what the in-between blocksizes buy us, we also work out what it
+  // would have been with only the power-of-two blocksizes, which is what each
+  // allocation would have been rounded up to without them.
+  unsigned long long requested = 0, allocated = 0, allocated_pow2 = 0;
+  printf("mem: small blocks\n");
+  printf("  %9s %8s %8s %8s %10s %6s\n", "blocksize", "live", "peak", "pages", "allocs", "waste");
+  for (int i = 0; i < NUM_BLOCKSIZES; i++) {
+    struct smallblock_stats *st = &smallblock_stats[i];
+    if (st->allocs == 0)
+      continue;
+    unsigned int blocksize = smallblock[i].blocksize;
+    unsigned int pow2 = blocksizes[0];
+    while (pow2 < blocksize)
+      pow2 *= 2;
+    unsigned long long bytes = (unsigned long long)st->allocs * blocksize;
+    requested += st->requested;
+    allocated += bytes;
+    allocated_pow2 += (unsigned long long)st->allocs * pow2;
+    printf("  %9u %8u %8u %8u %10u %5u%%\n", blocksize, st->live, st->peak, st->pages,
+	st->allocs, (unsigned int)((bytes - st->requested) * 100 / bytes));
+  }
+  if (allocated > 0)
+    printf("  internal fragmentation: %u%% with these blocksizes, %u%% with power-of-two blocksizes only\n",
+	(unsigned int)((allocated - requested) * 100 / allocated),
+	(unsigned int)((allocated_pow2 - requested) * 100 / allocated_pow2));
+
+  // find the largest run of free pages
+  int level = intr_disable();
+  spin_lock(&page_alloc_lock);
+  unsigned int largest = 0, run = 0;
+  for (int i = 0; i < ram_pages - pages_reserved; i++) {
+    run = bitmap_get(page_alloc_bitmap, i) ? 0 : run + 1;
+    if (run > largest)
+      largest = run;
+  }
+  unsigned int free_now = pages_free, failures = page_alloc_failures;
+  spin_unlock(&page_alloc_lock);
+  intr_restore(level);
+  unsigned int cached = 0;
+  for (int c = 0; c < MAX_CORES; c++)
+    cached += page_caches[c].count;
+
+  printf("mem: pages\n");
+  printf("  %u total, %u reserved, %u free, %u free in per-core caches, largest free run %u, %u failed requests\n",
+      ram_pages, pages_reserved, free_now, cached, largest, failures);
+  printf("  %u in large blocks, %u in vmalloc blocks, %u pre-zeroed\n",
+      bigblock_pages, vmalloc_pages, zeropool_count);
+  printf("  %u of %u DMA pages in use\n", dma_pages_used, dma_pages);
+  printf("  page_alloc_lock taken %u times, %u spins waiting for it\n",
+      page_alloc_lock.acquisitions, page_alloc_lock.spins);
+
+  printf("mem: costs (1 in %d calls sampled)\n", MEM_STATS_SAMPLE);
+  cost_print(&malloc_cost);
+  cost_print(&free_cost);
+  cost_print(&alloc_pages_cost);
+}
+
 void mem_init()
 {
   for (int i = 0; i < 16; i++) {
@@ -351,7 +1544,9 @@ void mem_init()
       ram_end_page = bootparams->devtable[i].end / PAGE_SIZE;
       ram_pages = ram_end_page - ram_start_page;
       page_alloc_init();
+      vmalloc_init();
       malloc_init();
+      heap_profile_rate = bootparam_int("heapprof", 0);
       return;
     }
   }
@@ -0,0 +1,125 @@
+#include "kernel.h"
+
+// Network device driver.
+//
+// The receive ring and every packet buffer live in DMA memory, so the physical
+// addresses the device needs are just dma_to_physical() of their virtual
+// addresses. Free buffers are kept in a lock-free MPMC queue, since packets are
+// usually finished with on some other core than the one that received them.
+// A queue of NET_BUFFERS slots is big enough for every buffer, so giving one
+// back can never fail.
+//
+// The device's drop count is read with a cmd/data pair of registers, which
+// only one core can safely use at a time. So while the timer is running, only
+// a timer callback (always on core 0) reads it, every NET_DROP_SAMPLE_USEC, and
+// network_dropcount() just returns the latest sample, from any core.
+
+#define NET_DROP_SAMPLE_USEC 100000 // 100 ms
+
+// a pointer to the memory-mapped I/O region for the network device
+static volatile struct dev_net *dev_net;
+
+static volatile struct dma_ring_slot *rx_ring; // NET_MAX_RING_CAPACITY slots
+static struct mpmc_queue free_buffers;
+static unsigned int rx_refill_failures; // packets dropped because no buffer was free
+static struct timer drop_timer;
+static volatile unsigned int drop_sample; // device drop count, as of the last sample
+static int drop_sampling; // 1 if drop_timer is keeping drop_sample up to date
+
+static unsigned int network_device_drops()
+{
+  dev_net->cmd = NET_GET_DROPCOUNT;
+  return dev_net->data;
+}
+
+static void network_sample_drops(void *arg)
+{
+  drop_sample = network_device_drops();
+}
+
+int network_init()
+{
+  /* Find out where I/O region is in memory. */
+  for (int i = 0; i < 16; i++) {
+    if (bootparams->devtable[i].type == DEV_TYPE_NETWORK) {
+      puts("Detected network device...");
+      // find a virtual address that maps to this I/O region
+      dev_net = physical_to_virtual(bootparams->devtable[i].start);
+      break;
+    }
+  }
+  if (!dev_net)
+    return 0;
+
+  // set aside all of the packet buffers
+  mpmc_init(&free_buffers, NET_BUFFERS);
+  void *bufs = dma_alloc(NET_BUFFERS);
+  for (int i = 0; i < NET_BUFFERS; i++)
+    mpmc_push(&free_buffers, bufs + i * PAGE_SIZE);
+
+  // fill the ring with empty buffers
+  rx_ring = dma_alloc(1);
+  for (int i = 0; i < NET_MAX_RING_CAPACITY; i++) {
+    rx_ring[i].dma_base = dma_to_physical(mpmc_pop(&free_buffers));
+    rx_ring[i].dma_len = NET_MAXPKT;
+  }
+
+  // tell the device about the ring, then turn it on
+  dev_net->cmd = NET_SET_POWER;
+  dev_net->data = 1;
+  dev_net->rx_base = dma_to_physical((void *)rx_ring);
+  dev_net->rx_capacity = NET_MAX_RING_CAPACITY;
+  dev_net->rx_head = 0;
+  dev_net->rx_tail = 0;
+  dev_net->cmd = NET_SET_RECEIVE;
+  dev_net->data = 1;
+
+  // from now on, keep a sample of the drop count instead of asking each time
+  unsigned int period = timer_usec_to_ticks(NET_DROP_SAMPLE_USEC);
+  if (period) {
+    drop_sample = network_device_drops();
+    drop_sampling = 1;
+    timer_every(&drop_timer, period, network_sample_drops, 0);
+  }
+  puts("...network driver is ready.");
+  return 1;
+}
+
+void *network_poll(unsigned int *len)
+{
+  unsigned int tail = dev_net->rx_tail;
+  if (dev_net->rx_head == tail)
+    return 0; // ring is empty
+  volatile struct dma_ring_slot *slot = &rx_ring[tail % NET_MAX_RING_CAPACITY];
+  void *buf = physical_to_dma(slot->dma_base);
+  *len = slot->dma_len;
+
+  // swap in a fresh buffer, or if there are none, drop this packet and let the
+  // device have its buffer back
+  void *fresh = mpmc_pop(&free_buffers);
+  if (!fresh) {
+    rx_refill_failures++;
+    fresh = buf;
+    buf = 0;
+  }
+  slot->dma_base = dma_to_physical(fresh);
+  slot->dma_len = NET_MAXPKT;
+  dev_net->rx_tail = tail + 1;
+  return buf;
+}
+
+void network_buffer_free(void *buf)
+{
+  if (!mpmc_push(&free_buffers, buf)) {
+    printf("network_buffer_free: more buffers came back than were handed out\n");
+    shutdown();
+  }
+}
+
+unsigned int network_dropcount()
+{
+  // note: without the timer, this asks the device directly, which is only safe
+  // while no other core is doing the same
+  unsigned int drops = drop_sampling ? drop_sample : network_device_drops();
+  return drops + rx_refill_failures;
+}
@@ -0,0 +1,46 @@
+#ifndef NETWORK_H_
+#define NETWORK_H_
+
+/* Network device driver interface.
+ *
+ * The network device driver provides these functions:
+ *   network_init() initializes the driver and turns on packet reception
+ *   network_poll() takes the next received packet, if any, off the ring
+ *   network_buffer_free() hands a packet buffer back to the driver
+ *   network_dropcount() reports how many packets the device had to drop
+ *
+ * The driver does not use interrupts. Instead, some core calls network_poll()
+ * whenever it is ready for more packets. Only one core at a time may call
+ * network_poll(), since the receive ring has only one consumer. Any core may
+ * call network_buffer_free(), at any time, including while network_poll() is
+ * running on another core, and not necessarily in the order the packets
+ * arrived.
+ *
+ * Each packet buffer is one page of DMA memory, of which the device only ever
+ * writes the first NET_MAXPKT bytes. The rest of the page (see
+ * NET_BUFFER_SPARE) is free for the kernel to keep its own notes about the
+ * packet in. There are NET_BUFFERS buffers in total, including the ones sitting
+ * in the receive ring, so no more than NET_BUFFERS - NET_MAX_RING_CAPACITY
+ * packets are ever handed out at once. While the kernel holds on to them all,
+ * the device drops any new packets.
+ */
+
+#define NET_BUFFERS 128 // must be a power of two
+#define NET_BUFFER_SPARE (PAGE_SIZE - NET_MAXPKT) // unused bytes at the end of each buffer
+
+// detect the network device and start receiving; returns 0 if there is no
+// network device
+int network_init();
+
+// take the next received packet off the ring, and return a pointer to it, with
+// its length in *len; returns 0 if no packet has arrived
+void *network_poll(unsigned int *len);
+
+// give back a buffer that came from network_poll()
+void network_buffer_free(void *buf);
+
+// count of packets the device dropped because the ring was full (or no buffer
+// was free); while the timer is running, this is a sample up to 100 ms old
+unsigned int network_dropcount();
+
+#endif
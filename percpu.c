@@ -0,0 +1,84 @@
+#include "kernel.h"
+
+// Per-core copies of the .percpu section (see DEFINE_PER_CPU() in kernel.h).
+//
+// The linker script gathers every per-core variable into .percpu, which starts
+// and ends on a page boundary, between __percpu_start and __percpu_end. Core 0
+// keeps using the section itself, while each other core gets a copy in memory
+// from alloc_pages(). All copies come from one contiguous allocation, laid end
+// to end, so each core's block starts on its own page and no two cores ever
+// share a cache line.
+//
+// With PERCPU_PRIVATE_MAPPING, each other core also gets a private page
+// directory. It is a copy of the one core 0 uses (so it includes the vmalloc
+// page tables, which are shared, as long as vmalloc_init() has already run),
+// except that the entry covering .percpu points to a private copy of that page
+// table, in which the .percpu pages map to the core's own block. Nothing else
+// ever changes the mappings in that page table, so the copies never go stale.
+
+extern char __percpu_start[], __percpu_end[];
+
+unsigned int percpu_offset[MAX_CORES];
+
+#if PERCPU_PRIVATE_MAPPING
+static unsigned int percpu_context[MAX_CORES]; // Context register value for each core
+
+// build a page directory that maps .percpu to the given block instead
+static unsigned int percpu_map(char *block)
+{
+  unsigned int start = (unsigned int)__percpu_start;
+  unsigned int end = (unsigned int)__percpu_end;
+  if ((start >> 22) != ((end - 1) >> 22)) {
+    printf("percpu_init: .percpu section spans more than one page table\n");
+    shutdown();
+  }
+  unsigned int *pd = physical_to_virtual(current_cpu_context() & ~0xFFF);
+  unsigned int pdi = start >> 22;
+  unsigned int *pt = physical_to_virtual(pd[pdi] & ~0xFFF);
+
+  unsigned int *my_pd = alloc_pages(1);
+  unsigned int *my_pt = alloc_pages(1);
+  memcpy(my_pd, pd, PAGE_SIZE);
+  memcpy(my_pt, pt, PAGE_SIZE);
+  for (unsigned int va = start; va < end; va += PAGE_SIZE) {
+    unsigned int pti = (va >> 12) & 0x3ff;
+    unsigned int paddr = virtual_to_physical(block + (va - start));
+    my_pt[pti] = paddr | (pt[pti] & 0xFFF); // same permission bits, different page
+  }
+  my_pd[pdi] = virtual_to_physical(my_pt) | (pd[pdi] & 0xFFF);
+  return virtual_to_physical(my_pd);
+}
+#endif
+
+void percpu_init()
+{
+  unsigned int size = __percpu_end - __percpu_start;
+  unsigned int ncores = current_cpu_exists();
+#if PERCPU_PRIVATE_MAPPING
+  // other cores see core 0's block through its physical address mapping, since
+  // the template's own address means their own block once they switch over
+  percpu_offset[0] = (char *)physical_to_virtual(virtual_to_physical(__percpu_start)) - __percpu_start;
+#endif
+  if (size == 0 || ncores < 2)
+    return;
+  unsigned int pages = size * (ncores - 1) / PAGE_SIZE;
+  char *copies = alloc_pages(pages);
+  for (int i = 1; i < ncores; i++) {
+    char *copy = copies + (i - 1) * size;
+    memcpy(copy, __percpu_start, size);
+    percpu_offset[i] = copy - __percpu_start;
+#if PERCPU_PRIVATE_MAPPING
+    percpu_context[i] = percpu_map(copy);
+#endif
+  }
+  printf("percpu_init: %d bytes of per-core data, %d pages for %d copies\n", size, pages, ncores - 1);
+}
+
+void percpu_enter()
+{
+#if PERCPU_PRIVATE_MAPPING
+  unsigned int id = current_cpu_id();
+  if (id != 0 && percpu_context[id])
+    set_cpu_context(percpu_context[id]);
+#endif
+}
@@ -0,0 +1,331 @@
+#include "kernel.h"
+
+// The packet path, as a configurable pipeline.
+//
+// Each packet goes through four stages, in order:
+//   RX      take the packet off the network ring
+//   HASH    parse the headers and hash the whole packet
+//   LOOKUP  carry out a command, or check the honeypot lists
+//   STATS   add the packet to the statistics and give back its buffer
+//
+// Every core is assigned a set of stages at boot. Between consecutive stages
+// there is a lock-free MPMC queue of packets waiting for the next stage, so
+// any number of cores can feed any number of others. A core that runs several
+// stages in a row takes a packet through all of them at once, and only queues
+// it for the first stage it doesn't run itself.
+//
+// The assignment comes from the "pipeline" boot parameter:
+//   (none)             run to completion: core 0 drains the ring, and every
+//                      other core takes packets from there through all of the
+//                      remaining stages
+//   pipeline=R:H:L:S   staged: the first R cores drain the ring (R must be 1,
+//                      since the ring has only one consumer), the next H cores
+//                      hash, the next L cores do lookups, and the next S cores
+//                      do statistics; any cores left over run no stages
+//
+// With the "sharded" boot parameter, each lookup core has its own shard of the
+// honeypot lists (see honeypot.c), and packets are steered to their owners
+// rather than shared: the RX core reads the source address of each packet (or
+// the address in a spammer command), hashes it to pick a shard, and from the
+// first stage that runs on the lookup cores onward, the packet goes to its
+// owner's own queue instead of the shared one. Commands that change the evil or
+// vulnerable lists, and PRINT, go to every shard instead, by being passed from
+// one lookup core to the next before going on to STATS.
+//
+// A watchdog timer checks every PIPELINE_WATCHDOG_USEC that each core with
+// stages to run is still polling, i.e. hasn't got stuck in some work item or
+// task. It runs in the timer interrupt, so it only makes a note of any stalled
+// cores, and core 0 prints the news the next time it polls.
+//
+// The notes for each packet (struct pkt_desc) live in the unused space at the
+// end of its buffer, so passing a packet between cores never allocates. There
+// are only NET_BUFFERS buffers, so queues of that size can never fill up.
+
+enum { STAGE_RX, STAGE_HASH, STAGE_LOOKUP, STAGE_STATS, NSTAGES };
+static char *stage_names[NSTAGES] = { "rx", "hash", "lookup", "stats" };
+
+#define PIPELINE_RX_BATCH 8 // packets to drain from the ring per poll
+#define PIPELINE_WATCHDOG_USEC 1000000 // how often to check that every core is polling
+
+struct pkt_desc {
+  void *buf;
+  struct hp_packet p;
+  unsigned int key; // picks the shard, if sharded
+  int broadcast; // 1 if every shard needs to see this packet
+  int stage; // stage to start at, when taken from a shard queue
+};
+
+#define PKT_DESC(buf) ((struct pkt_desc *)((buf) + PAGE_SIZE - sizeof(struct pkt_desc)))
+
+typedef char pkt_desc_fits_in_buffer[sizeof(struct pkt_desc) <= NET_BUFFER_SPARE ? 1 : -1];
+
+struct pipeline_core {
+  unsigned int stages; // bit mask of stages this core runs
+  unsigned int done[NSTAGES]; // packets this core took through each stage
+  int shard; // index of this core's honeypot shard, or -1 if it has none
+  volatile unsigned int polls; // times this core has polled
+  unsigned int polls_seen; // polls as of the last watchdog check
+  unsigned int pad[8];
+};
+
+static struct pipeline_core pipeline_cores[MAX_CORES];
+static struct mpmc_queue stage_queue[NSTAGES]; // packets waiting for each stage (except RX)
+
+static unsigned int nshards; // lookup cores with a shard each, or 0 if not sharded
+static int shard_cores[MAX_CORES]; // core that owns each shard
+static int steer_stage; // first stage that runs on the shard owners
+static struct mpmc_queue shard_queue[MAX_CORES]; // packets steered to each owner core
+
+static struct timer watchdog_timer;
+static volatile unsigned int stalled_cores; // cores that stopped polling, as of the last check
+static unsigned int stalled_reported; // stalled_cores, as of the last report
+
+// which shard owns key; multiplying by 2^32 / golden ratio spreads out nearby
+// addresses, and the top bits of the product then scale it down to nshards
+static inline unsigned int pipeline_shard_of(unsigned int key)
+{
+  return ((unsigned long long)(key * 2654435761u) * nshards) >> 32;
+}
+
+// queue d on the given core's shard queue, starting at stage
+static void pipeline_send(int core, int stage, struct pkt_desc *d)
+{
+  d->stage = stage;
+  if (!mpmc_push(&shard_queue[core], d)) {
+    printf("pipeline: shard queue of core %d overflowed\n", core);
+    shutdown();
+  }
+}
+
+static void pipeline_enqueue(int stage, struct pkt_desc *d)
+{
+  if (nshards && stage == steer_stage) {
+    pipeline_send(shard_cores[d->broadcast ? 0 : pipeline_shard_of(d->key)], stage, d);
+    return;
+  }
+  if (!mpmc_push(&stage_queue[stage], d)) {
+    printf("pipeline: %s queue overflowed\n", stage_names[stage]);
+    shutdown();
+  }
+}
+
+// a PRINT command has reached this core's lookup stage: the first shard prints
+// the totals, each one prints its own lists, and the last adds the stage counts
+static void pipeline_print(struct pipeline_core *c)
+{
+  if (c->shard <= 0)
+    honeypot_print_totals();
+  honeypot_print_lists();
+  if (c->shard < 0 || c->shard == nshards - 1)
+    pipeline_print_stats();
+}
+
+// take a packet through stage and as many of the stages after it as this core
+// runs, then hand it to whichever stage is next
+static void pipeline_process(struct pipeline_core *c, struct pkt_desc *d, int stage)
+{
+  for (; stage < NSTAGES; stage++) {
+    if (!(c->stages & (1 << stage))) {
+      pipeline_enqueue(stage, d);
+      return;
+    }
+    switch (stage) {
+      case STAGE_HASH:
+	honeypot_parse(d->buf, d->p.len, &d->p);
+	break;
+      case STAGE_LOOKUP:
+	honeypot_lookup(&d->p);
+	if ((d->p.flags & HP_COMMAND) && d->p.cmd == HONEYPOT_PRINT)
+	  pipeline_print(c);
+	if (nshards && d->broadcast && c->shard + 1 < nshards) {
+	  // on to the next shard, which continues from here
+	  c->done[stage]++;
+	  pipeline_send(shard_cores[c->shard + 1], STAGE_LOOKUP, d);
+	  return;
+	}
+	break;
+      case STAGE_STATS:
+	honeypot_account(&d->p);
+	network_buffer_free(d->buf);
+	break;
+    }
+    c->done[stage]++;
+  }
+}
+
+// check that every core has polled since the last check; runs in the timer
+// interrupt, on core 0
+static void pipeline_watchdog(void *arg)
+{
+  unsigned int stalled = 0;
+  for (int i = 0; i < current_cpu_exists(); i++) {
+    struct pipeline_core *c = &pipeline_cores[i];
+    if (!c->stages)
+      continue;
+    unsigned int polls = c->polls;
+    if (polls == c->polls_seen)
+      stalled |= 1 << i;
+    c->polls_seen = polls;
+  }
+  stalled_cores = stalled;
+}
+
+// print which cores have stopped or started polling since the last report
+static void pipeline_report_stalls()
+{
+  unsigned int stalled = stalled_cores;
+  for (int i = 0; i < current_cpu_exists(); i++) {
+    unsigned int bit = 1 << i;
+    if ((stalled & bit) && !(stalled_reported & bit))
+      printf("pipeline: watchdog: core %d has stopped polling\n", i);
+    else if (!(stalled & bit) && (stalled_reported & bit))
+      printf("pipeline: watchdog: core %d is polling again\n", i);
+  }
+  stalled_reported = stalled;
+}
+
+static int pipeline_poll()
+{
+  int id = current_cpu_id();
+  struct pipeline_core *c = &pipeline_cores[id];
+  int work = 0;
+  c->polls++;
+  if (id == 0 && stalled_cores != stalled_reported)
+    pipeline_report_stalls();
+  if (c->stages & (1 << STAGE_RX)) {
+    for (int i = 0; i < PIPELINE_RX_BATCH; i++) {
+      unsigned int len;
+      void *buf = network_poll(&len);
+      if (!buf)
+	break;
+      struct pkt_desc *d = PKT_DESC(buf);
+      d->buf = buf;
+      d->p.len = len;
+      d->broadcast = nshards ? honeypot_steer(buf, len, &d->key) : 0;
+      c->done[STAGE_RX]++;
+      pipeline_process(c, d, STAGE_HASH);
+      work = 1;
+    }
+  }
+  if (c->shard >= 0) {
+    struct pkt_desc *d = mpmc_pop(&shard_queue[id]);
+    if (d) {
+      pipeline_process(c, d, d->stage);
+      work = 1;
+    }
+  }
+  for (int stage = STAGE_HASH; stage < NSTAGES; stage++) {
+    if (!(c->stages & (1 << stage)))
+      continue;
+    struct pkt_desc *d = mpmc_pop(&stage_queue[stage]);
+    if (d) {
+      pipeline_process(c, d, stage);
+      work = 1;
+    }
+  }
+  if (!work && (c->stages & (1 << STAGE_STATS)))
+    honeypot_stats_flush(); // quiet for now, so bring the totals up to date
+  return work;
+}
+
+// parse "R:H:L:S" into counts; returns 0 if it isn't of that form
+static int pipeline_parse(char *s, unsigned int counts[NSTAGES])
+{
+  for (int stage = 0; stage < NSTAGES; stage++) {
+    if (*s < '0' || *s > '9')
+      return 0;
+    counts[stage] = 0;
+    for (; *s >= '0' && *s <= '9'; s++)
+      counts[stage] = counts[stage] * 10 + (*s - '0');
+    if (*s != (stage == NSTAGES - 1 ? '\0' : ':'))
+      return 0;
+    if (*s)
+      s++;
+  }
+  return 1;
+}
+
+void pipeline_init()
+{
+  unsigned int ncores = current_cpu_exists();
+  for (int stage = STAGE_HASH; stage < NSTAGES; stage++)
+    mpmc_init(&stage_queue[stage], NET_BUFFERS);
+
+  char *param = bootparam("pipeline");
+  unsigned int counts[NSTAGES];
+  int staged = 0;
+  if (param) {
+    unsigned int total = 0;
+    staged = pipeline_parse(param, counts);
+    for (int stage = 0; staged && stage < NSTAGES; stage++) {
+      total += counts[stage];
+      if (counts[stage] == 0)
+	staged = 0;
+    }
+    if (!staged || counts[STAGE_RX] != 1 || total > ncores) {
+      printf("pipeline: can't use \"%s\" on %d cores, running to completion instead\n", param, ncores);
+      staged = 0;
+    }
+  }
+
+  if (staged) {
+    int core = 0;
+    for (int stage = 0; stage < NSTAGES; stage++)
+      for (int i = 0; i < counts[stage]; i++)
+	pipeline_cores[core++].stages = 1 << stage;
+    printf("pipeline: staged, %d rx, %d hash, %d lookup, %d stats cores\n",
+	counts[STAGE_RX], counts[STAGE_HASH], counts[STAGE_LOOKUP], counts[STAGE_STATS]);
+  } else {
+    unsigned int rest = (1 << STAGE_HASH) | (1 << STAGE_LOOKUP) | (1 << STAGE_STATS);
+    pipeline_cores[0].stages = (1 << STAGE_RX) | (ncores == 1 ? rest : 0);
+    for (int i = 1; i < ncores; i++)
+      pipeline_cores[i].stages = rest;
+    printf("pipeline: run to completion, 1 rx core, %d worker cores\n", ncores > 1 ? ncores - 1 : 1);
+  }
+
+  // give each lookup core a shard, if asked to
+  for (int i = 0; i < ncores; i++) {
+    pipeline_cores[i].shard = -1;
+    if (!honeypot_is_sharded() || !(pipeline_cores[i].stages & (1 << STAGE_LOOKUP)))
+      continue;
+    pipeline_cores[i].shard = nshards;
+    shard_cores[nshards++] = i;
+    mpmc_init(&shard_queue[i], NET_BUFFERS);
+  }
+  if (nshards) {
+    // every lookup core runs the same stages, so steer at the first of them
+    // after RX; e.g. at HASH when running to completion, or at LOOKUP when staged
+    unsigned int stages = pipeline_cores[shard_cores[0]].stages;
+    for (steer_stage = STAGE_HASH; !(stages & (1 << steer_stage)); steer_stage++)
+      ;
+    printf("pipeline: honeypot lists sharded across %d lookup cores, steered at %s\n",
+	nshards, stage_names[steer_stage]);
+  }
+}
+
+void pipeline_start()
+{
+  if (pipeline_cores[current_cpu_id()].stages)
+    sched_set_poll(pipeline_poll);
+  // core 0 starts the watchdog once it is polling too (it always runs RX)
+  unsigned int period = timer_usec_to_ticks(PIPELINE_WATCHDOG_USEC);
+  if (current_cpu_id() == 0 && period)
+    timer_every(&watchdog_timer, period, pipeline_watchdog, 0);
+}
+
+void pipeline_print_stats()
+{
+  printf("pipeline stats:\n");
+  for (int i = 0; i < current_cpu_exists(); i++) {
+    struct pipeline_core *c = &pipeline_cores[i];
+    if (!c->stages)
+      continue;
+    printf("  core %2d:", i);
+    if (c->shard >= 0)
+      printf(" (shard %d)", c->shard);
+    for (int stage = 0; stage < NSTAGES; stage++)
+      if (c->stages & (1 << stage))
+	printf(" %s %u", stage_names[stage], c->done[stage]);
+    printf("\n");
+  }
+}
@@ -0,0 +1,83 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include "kernel.h"
+
+/* Typed fixed-size object pools.
+ *
+ * For the few object types that get allocated and freed constantly (hash
+ * nodes, packet descriptors, queue entries, etc.), malloc() does more work than
+ * needed: it searches for a free block by size, checks magic numbers, and
+ * updates bitmaps. A pool instead hands out objects of exactly one type from a
+ * free list threaded through the free objects themselves, so allocating and
+ * freeing are each a couple of loads and stores, compiled inline.
+ *
+ * DEFINE_POOL(name, type, per_page) defines:
+ *   struct name_pool, which should start out zeroed (e.g. a global)
+ *   type *name_pool_alloc(struct name_pool *pool)
+ *   void name_pool_free(struct name_pool *pool, type *obj)
+ *
+ * When the free list runs dry, the pool takes a whole page from alloc_pages()
+ * and carves it into per_page objects (per_page * sizeof(type) must fit in a
+ * page; the compiler checks this). Pages are never given back.
+ *
+ * Pools are not synchronized in any way. The intent is for each core to have
+ * its own pool for each type, e.g. "struct node_pool node_pools[MAX_CORES]",
+ * with objects normally freed back to the pool of the core that allocated them.
+ *
+ * Example:
+ *
+ *   DEFINE_POOL(node, struct node, 64)
+ *   static struct node_pool nodes;
+ *   ...
+ *   struct node *n = node_pool_alloc(&nodes);
+ *   ...
+ *   node_pool_free(&nodes, n);
+ */
+
+#define DEFINE_POOL(name, type, per_page)					\
+									\
+union name##_pool_obj {							\
+  union name##_pool_obj *next; /* while on the free list */		\
+  type obj; /* while allocated */					\
+};									\
+									\
+typedef char name##_pool_fits_in_page[					\
+  (per_page) * sizeof(union name##_pool_obj) <= PAGE_SIZE ? 1 : -1];	\
+									\
+struct name##_pool {							\
+  union name##_pool_obj *free; /* free list */				\
+  unsigned int pages; /* pages taken from alloc_pages() */		\
+  unsigned int live; /* objects currently allocated */			\
+};									\
+									\
+static void __attribute__ ((noinline))					\
+name##_pool_grow(struct name##_pool *pool)				\
+{									\
+  union name##_pool_obj *o = alloc_pages(1);				\
+  for (int i = 0; i < (per_page); i++) {				\
+    o[i].next = pool->free;						\
+    pool->free = &o[i];							\
+  }									\
+  pool->pages++;							\
+}									\
+									\
+static inline type *name##_pool_alloc(struct name##_pool *pool)		\
+{									\
+  if (__builtin_expect(pool->free == 0, 0))				\
+    name##_pool_grow(pool);						\
+  union name##_pool_obj *o = pool->free;				\
+  pool->free = o->next;							\
+  pool->live++;								\
+  return &o->obj;							\
+}									\
+									\
+static inline void name##_pool_free(struct name##_pool *pool, type *obj)	\
+{									\
+  union name##_pool_obj *o = (union name##_pool_obj *)obj;		\
+  o->next = pool->free;							\
+  pool->free = o;							\
+  pool->live--;								\
+}
+
+#endif
@@ -561,14 +561,14 @@ int printf_i (const char *format, ...)
   return ret;
 }
 
-/*
-static int printf_mutex = 0;
+static struct spinlock printf_mutex;
+
 int printf_m (const char *format, ...)
 {
   int *varg = (int *) (char *) (&format);
-  mutex_lock(&printf_mutex);
+  spin_lock(&printf_mutex);
   int ret = print (0, varg);
-  mutex_unlock(&printf_mutex);
+  spin_unlock(&printf_mutex);
   return ret;
 }
 
@@ -576,32 +576,23 @@ int printf_im (const char *format, ...)
 {
   int *varg = (int *) (char *) (&format);
   int level = intr_disable();
-  mutex_lock(&printf_mutex);
-  int ret = print (0, varg);
-  mutex_unlock(&printf_mutex);
-  intr_restore(level);
-  return ret;
-}
-
-int printf (const char *format, ...)
-{
-  int *varg = (int *) (char *) (&format);
-  int level = intr_disable();
-  mutex_lock(&printf_mutex);
+  spin_lock(&printf_mutex);
   int ret = print (0, varg);
-  mutex_unlock(&printf_mutex);
+  spin_unlock(&printf_mutex);
   intr_restore(level);
   return ret;
 }
 
-*/
-
-// default printf is the same as printf_i, for now
+// default printf is the same as printf_im: interrupts off, then the mutex, so
+// that lines printed from different cores (or from interrupt handlers) are
+// never interleaved
 int printf (const char *format, ...)
 {
   int *varg = (int *) (char *) (&format);
   int level = intr_disable();
+  spin_lock(&printf_mutex);
   int ret = print (0, varg);
+  spin_unlock(&printf_mutex);
   intr_restore(level);
   return ret;
 }
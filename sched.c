@@ -0,0 +1,355 @@
+#include "kernel.h"
+
+// A work-stealing scheduler.
+//
+// Each core has its own deque of work items (Chase and Lev's design). The owner
+// pushes and pops items at the bottom of its deque without any atomic
+// operations in the common case, while idle cores steal from the top of some
+// other core's deque, using atomic_cas() to settle races over the last items.
+// So work submitted on one core stays there, hot in its cache, unless some
+// other core runs out of things to do, in which case the load evens out on its
+// own no matter how uneven the work items are.
+//
+// Each deque is a fixed ring of SCHED_DEQUE_SIZE items. If a core submits work
+// faster than it can be run or stolen and its deque fills up, sched_submit()
+// just runs the item right away.
+//
+// Work items should be short, e.g. one packet or one batch of packets. Longer
+// background jobs belong in tasks (see task.c), which sched_run() lets run
+// whenever it runs out of work items, and every SCHED_YIELD_EVERY items
+// otherwise.
+//
+// Owners pop the most recently pushed item (good for cache locality), while
+// thieves steal the oldest one (likely to be the biggest chunk of remaining
+// work, if items spawn more items). Top and bottom only ever count up, wrapping
+// harmlessly since only their differences are used.
+
+#define SCHED_DEQUE_SIZE 256 // must be a power of two
+#define SCHED_YIELD_EVERY 64 // when busy, let background tasks run after this many items
+
+struct work_item {
+  void (*fn)(void *arg);
+  void *arg;
+};
+
+struct sched_core {
+  volatile unsigned int top; // next item to steal; changed by thieves and the owner
+  unsigned int pad0[15];
+  volatile unsigned int bottom; // next free slot; changed only by the owner
+  unsigned int rng; // state for picking victims at random
+  unsigned int executed; // items run on this core
+  unsigned int stolen; // items this core stole from others
+  unsigned int steal_failures; // steal attempts that came back empty
+  unsigned int overflows; // items run right away because the deque was full
+  int (*poll)(); // polled by sched_run() before looking for work items, or 0
+  unsigned int pad1[9];
+  struct work_item items[SCHED_DEQUE_SIZE];
+};
+
+static struct sched_core sched_cores[MAX_CORES];
+
+// add an item to the bottom of this core's own deque; returns 0 if it is full
+static int deque_push(struct sched_core *c, struct work_item *w)
+{
+  unsigned int b = c->bottom;
+  unsigned int t = c->top;
+  if (b - t >= SCHED_DEQUE_SIZE)
+    return 0;
+  c->items[b & (SCHED_DEQUE_SIZE - 1)] = *w;
+  compiler_barrier();
+  c->bottom = b + 1;
+  return 1;
+}
+
+// take an item from the bottom of this core's own deque; returns 0 if empty
+static int deque_pop(struct sched_core *c, struct work_item *w)
+{
+  unsigned int b = c->bottom - 1;
+  c->bottom = b; // claim the bottom item before looking at top
+  compiler_barrier();
+  unsigned int t = c->top;
+  if ((int)(b - t) < 0) {
+    // it was already empty
+    c->bottom = t;
+    return 0;
+  }
+  *w = c->items[b & (SCHED_DEQUE_SIZE - 1)];
+  if (b != t)
+    return 1; // more items are left, so no thief can be after this one
+  // this is the last item, so race any thieves for it
+  int won = (atomic_cas(&c->top, t, t + 1) == t);
+  c->bottom = t + 1;
+  return won;
+}
+
+// take an item from the top of another core's deque; returns 0 if it is empty,
+// or if some other core got to the item first
+static int deque_steal(struct sched_core *c, struct work_item *w)
+{
+  unsigned int t = c->top;
+  compiler_barrier();
+  unsigned int b = c->bottom;
+  if ((int)(b - t) <= 0)
+    return 0;
+  // the slot can't be reused by the owner until top moves past it, so this
+  // copy is good as long as the atomic_cas() below succeeds
+  *w = c->items[t & (SCHED_DEQUE_SIZE - 1)];
+  return atomic_cas(&c->top, t, t + 1) == t;
+}
+
+void sched_submit(void (*fn)(void *arg), void *arg)
+{
+  struct sched_core *c = &sched_cores[current_cpu_id()];
+  struct work_item w = { fn, arg };
+  if (!deque_push(c, &w)) {
+    c->overflows++;
+    c->executed++;
+    fn(arg);
+  }
+}
+
+// try once to steal an item from a randomly chosen other core
+static int sched_steal(struct sched_core *c, unsigned int id, struct work_item *w)
+{
+  unsigned int ncores = current_cpu_exists();
+  if (ncores < 2)
+    return 0;
+  if (!c->rng)
+    c->rng = 2463534242u + id * 0x9e3779b9;
+  // xorshift
+  c->rng ^= c->rng << 13;
+  c->rng ^= c->rng >> 17;
+  c->rng ^= c->rng << 5;
+  unsigned int victim = c->rng % (ncores - 1);
+  if (victim >= id)
+    victim++; // skip ourselves
+  if (deque_steal(&sched_cores[victim], w)) {
+    c->stolen++;
+    return 1;
+  }
+  c->steal_failures++;
+  return 0;
+}
+
+// run one item, either from this core's deque or stolen from a random victim;
+// returns 0 if there was nothing to run
+static int sched_run_one()
+{
+  unsigned int id = current_cpu_id();
+  struct sched_core *c = &sched_cores[id];
+  struct work_item w;
+  if (!deque_pop(c, &w) && !sched_steal(c, id, &w))
+    return 0;
+  c->executed++;
+  w.fn(w.arg);
+  return 1;
+}
+
+// background task that does mem_idle() chores a little at a time
+static void mem_idle_task(void *arg)
+{
+  while (1) {
+    mem_idle();
+    task_yield();
+  }
+}
+
+void sched_set_poll(int (*poll)())
+{
+  sched_cores[current_cpu_id()].poll = poll;
+}
+
+void sched_run()
+{
+  struct sched_core *c = &sched_cores[current_cpu_id()];
+  task_spawn(mem_idle_task, 0);
+  unsigned int streak = 0;
+  while (1) {
+    // poll and look for a work item every time around, so that neither can
+    // starve the other while the other keeps finding work
+    int busy = c->poll ? c->poll() : 0;
+    busy |= sched_run_one();
+    if (!busy) {
+      // nothing to do here, no polled work, and nothing at the victim we tried,
+      // so let background tasks run for a bit before looking again
+      task_yield();
+      streak = 0;
+    } else if (++streak == SCHED_YIELD_EVERY) {
+      // don't starve background tasks entirely when there is a lot of work
+      task_yield();
+      streak = 0;
+    }
+  }
+}
+
+void sched_print_stats()
+{
+  printf("scheduler stats:\n");
+  for (int i = 0; i < current_cpu_exists(); i++) {
+    struct sched_core *c = &sched_cores[i];
+    printf("  core %2d: %8u executed, %8u stolen, %8u failed steals, %u overflows\n",
+	i, c->executed, c->stolen, c->steal_failures, c->overflows);
+  }
+}
+
+
+// The following splits big memset() and memcpy() jobs across cores.
+//
+// The job is cut into chunks of PARALLEL_MEM_CHUNK bytes, aligned to page
+// boundaries of the destination (except at the ends), so no two cores ever
+// write the same page. Rather than one work item per chunk, the caller submits
+// one helper per other core, and every helper (and the caller itself) keeps
+// grabbing the next chunk with atomic_fetch_add() until none are left. Helpers
+// that don't get stolen in time are simply popped and run by the caller, so the
+// job always finishes even if every other core is busy. The job lives on the
+// caller's stack, so the caller waits for every helper to finish, not just for
+// every chunk, before returning. While it waits, it only ever runs its own
+// helpers, never anyone else's work items: the caller might be holding a lock
+// that some other item wants, or that item might start a big job of its own,
+// and so on without end.
+
+#define PARALLEL_MEM_CHUNK (4*PAGE_SIZE)
+#define PARALLEL_MEM_MIN (64*1024) // smaller jobs aren't worth splitting up
+
+struct mem_job {
+  void *dest;
+  const void *src; // 0 for memset()
+  unsigned int c; // byte value for memset()
+  unsigned int len;
+  unsigned int base; // dest rounded down to a page boundary
+  unsigned int nchunks;
+  volatile unsigned int next_chunk; // next chunk for someone to claim
+  volatile unsigned int helpers_left; // helpers not yet finished
+};
+
+// claim and process chunks until there are none left
+static void mem_job_work(struct mem_job *job)
+{
+  unsigned int i;
+  while ((i = atomic_fetch_add(&job->next_chunk, 1)) < job->nchunks) {
+    unsigned int start = job->base + i * PARALLEL_MEM_CHUNK;
+    unsigned int end = start + PARALLEL_MEM_CHUNK;
+    unsigned int dest = (unsigned int)job->dest;
+    if (start < dest)
+      start = dest;
+    if (end > dest + job->len)
+      end = dest + job->len;
+    if (job->src)
+      memcpy((void *)start, job->src + (start - dest), end - start);
+    else
+      memset((void *)start, job->c, end - start);
+  }
+}
+
+static void mem_job_helper(void *arg)
+{
+  struct mem_job *job = arg;
+  mem_job_work(job);
+  atomic_fetch_add(&job->helpers_left, -1);
+}
+
+static void mem_job_run(struct mem_job *job)
+{
+  unsigned int dest = (unsigned int)job->dest;
+  job->base = dest & ~(PAGE_SIZE - 1);
+  job->nchunks = (dest + job->len - job->base + PARALLEL_MEM_CHUNK - 1) / PARALLEL_MEM_CHUNK;
+  job->next_chunk = 0;
+  unsigned int helpers = current_cpu_exists() - 1;
+  if (helpers > job->nchunks - 1)
+    helpers = job->nchunks - 1;
+  job->helpers_left = helpers;
+  for (int i = 0; i < helpers; i++)
+    sched_submit(mem_job_helper, job);
+  mem_job_work(job);
+  // nothing was pushed after the helpers, so any that weren't stolen are still
+  // at the bottom of this core's deque
+  struct sched_core *c = &sched_cores[current_cpu_id()];
+  struct work_item w;
+  while (job->helpers_left && deque_pop(c, &w)) {
+    if (w.fn != mem_job_helper || w.arg != job) {
+      deque_push(c, &w); // someone else's, so the rest of ours were stolen
+      break;
+    }
+    mem_job_helper(job);
+    c->executed++;
+  }
+  while (job->helpers_left)
+    ; // the rest are running on other cores
+}
+
+void *parallel_memset(void *s, unsigned int c, unsigned int len)
+{
+  if (len < PARALLEL_MEM_MIN)
+    return memset(s, c, len);
+  struct mem_job job = { s, 0, c, len };
+  mem_job_run(&job);
+  return s;
+}
+
+void *parallel_memcpy(void *dest, const void *src, unsigned int len)
+{
+  if (len < PARALLEL_MEM_MIN)
+    return memcpy(dest, src, len);
+  struct mem_job job = { dest, src, 0, len };
+  mem_job_run(&job);
+  return dest;
+}
+
+
+// The following is a benchmark of load balancing under an uneven mix of work.
+//
+// Core 0 submits SCHED_BENCH_ITEMS items, each of which hashes a fake packet.
+// Most packets are small, but they come in runs, and some runs are all 4000
+// bytes, so whichever core happens to hold a run of big ones would fall far
+// behind under any static assignment. Whichever core finishes the last item
+// prints how much time each core spent hashing.
+
+#define SCHED_BENCH_ITEMS 2048
+#define SCHED_BENCH_RUN 32 // packets per run of similar sizes
+
+static unsigned char bench_packet[4000];
+static volatile unsigned int bench_done;
+static unsigned int bench_start;
+static unsigned int bench_busy[MAX_CORES]; // cycles each core spent hashing
+static volatile unsigned int bench_hash; // keeps the hashing from being optimized away
+
+static void bench_item(void *arg)
+{
+  unsigned int len = (unsigned int)arg;
+  unsigned int id = current_cpu_id();
+  unsigned int t0 = current_cpu_cycles();
+  unsigned int h = 2166136261u; // FNV-1a
+  for (int i = 0; i < len; i++)
+    h = (h ^ bench_packet[i]) * 16777619u;
+  bench_hash ^= h;
+  bench_busy[id] += current_cpu_cycles() - t0;
+
+  if (atomic_fetch_add(&bench_done, 1) + 1 < SCHED_BENCH_ITEMS)
+    return;
+
+  // this was the last one
+  unsigned int elapsed = current_cpu_cycles() - bench_start;
+  unsigned int ncores = current_cpu_exists();
+  unsigned int total = 0, most = 0;
+  for (int i = 0; i < ncores; i++) {
+    total += bench_busy[i];
+    if (bench_busy[i] > most)
+      most = bench_busy[i];
+  }
+  printf("sched_benchmark: %d items in %u cycles on %d cores\n", SCHED_BENCH_ITEMS, elapsed, ncores);
+  printf("  busiest core hashed for %u cycles, average core %u cycles\n", most, total / ncores);
+  sched_print_stats();
+}
+
+void sched_benchmark()
+{
+  for (int i = 0; i < sizeof(bench_packet); i++)
+    bench_packet[i] = i * 7;
+  bench_start = current_cpu_cycles();
+  unsigned int len = 64;
+  for (int i = 0; i < SCHED_BENCH_ITEMS; i++) {
+    if (i % SCHED_BENCH_RUN == 0)
+      len = (i / SCHED_BENCH_RUN) % 5 == 0 ? 4000 : 64 + (i % 7) * 64;
+    sched_submit(bench_item, (void *)len);
+  }
+}
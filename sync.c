@@ -0,0 +1,194 @@
+#include "kernel.h"
+
+// Synchronization primitives that are easier to write in C than in assembly,
+// built on top of the atomic operations in machine.s.
+
+void mcs_lock(struct mcs_lock *lock)
+{
+  struct mcs_node *me = &lock->node[current_cpu_id()];
+  me->next = 0;
+  me->waiting = 1;
+  // join the end of the queue
+  struct mcs_node *prev = (struct mcs_node *)atomic_swap((volatile unsigned int *)&lock->tail, (unsigned int)me);
+  unsigned int spins = 0;
+  if (prev) {
+    // someone is ahead of us, so link in behind them and wait for the handoff
+    prev->next = me;
+    while (me->waiting)
+      spins++;
+  }
+#if LOCK_STATS
+  lock->acquisitions++;
+  lock->spins += spins;
+#endif
+}
+
+void mcs_unlock(struct mcs_lock *lock)
+{
+  struct mcs_node *me = &lock->node[current_cpu_id()];
+  if (!me->next) {
+    // nobody seems to be waiting: if we are still the tail, the lock is free
+    if (atomic_cas((volatile unsigned int *)&lock->tail, (unsigned int)me, 0) == (unsigned int)me)
+      return;
+    // someone just swapped themselves in as tail, but hasn't linked in yet
+    while (!me->next)
+      ;
+  }
+  me->next->waiting = 0;
+}
+
+void barrier_wait(struct barrier *b, unsigned int n)
+{
+  unsigned int id = current_cpu_id();
+  unsigned int sense = !b->local_sense[id];
+  b->local_sense[id] = sense;
+  if (atomic_fetch_add(&b->count, 1) + 1 == n) {
+    // last to arrive: reset for the next round, then let everyone go
+    b->count = 0;
+    compiler_barrier();
+    b->sense = sense;
+  } else {
+    while (b->sense != sense)
+      ;
+  }
+}
+
+
+// The following is a benchmark comparing the locks above.
+//
+// For each core count, the first n cores all repeatedly take the same lock,
+// increment a shared counter, and release it, while core 0 times how long it
+// takes until they are all done. All cores (including the ones sitting out a
+// round) keep in step using a barrier.
+
+#define LOCK_BENCH_ITERS 200 // acquisitions per core per round
+
+static struct barrier bench_barrier;
+static volatile unsigned int bench_counter;
+static struct spinlock bench_spinlock;
+static struct ticketlock bench_ticketlock;
+static struct mcs_lock bench_mcs_lock;
+
+void lock_benchmark()
+{
+  static const unsigned int rounds[] = { 2, 8, 32 };
+  static const char *names[] = { "spinlock", "ticketlock", "mcs_lock" };
+  unsigned int id = current_cpu_id();
+  unsigned int ncores = current_cpu_exists();
+  if (id == 0)
+    printf("lock_benchmark: cycles per acquisition, %d acquisitions per core\n", LOCK_BENCH_ITERS);
+  for (int r = 0; r < 3; r++) {
+    unsigned int n = rounds[r];
+    if (n > ncores)
+      break;
+    unsigned int cycles[3];
+    for (int kind = 0; kind < 3; kind++) {
+      if (id == 0)
+	bench_counter = 0;
+      barrier_wait(&bench_barrier, ncores);
+      unsigned int t0 = current_cpu_cycles();
+      if (id < n) {
+	for (int i = 0; i < LOCK_BENCH_ITERS; i++) {
+	  if (kind == 0) {
+	    spin_lock(&bench_spinlock);
+	    bench_counter++;
+	    spin_unlock(&bench_spinlock);
+	  } else if (kind == 1) {
+	    ticket_lock(&bench_ticketlock);
+	    bench_counter++;
+	    ticket_unlock(&bench_ticketlock);
+	  } else {
+	    mcs_lock(&bench_mcs_lock);
+	    bench_counter++;
+	    mcs_unlock(&bench_mcs_lock);
+	  }
+	}
+      }
+      barrier_wait(&bench_barrier, ncores);
+      cycles[kind] = current_cpu_cycles() - t0;
+      if (id == 0 && bench_counter != n * LOCK_BENCH_ITERS)
+	printf("lock_benchmark: %s lost updates (%d of %d)\n", names[kind], bench_counter, n * LOCK_BENCH_ITERS);
+    }
+    if (id == 0)
+      printf("  %2d cores: %s %u, %s %u, %s %u\n", n,
+	  names[0], cycles[0] / (n * LOCK_BENCH_ITERS),
+	  names[1], cycles[1] / (n * LOCK_BENCH_ITERS),
+	  names[2], cycles[2] / (n * LOCK_BENCH_ITERS));
+  }
+}
+
+
+// The following is the lock-free MPMC queue.
+//
+// Positions count up forever (wrapping around after 2^32 items, which is
+// harmless since only differences are compared), and position pos uses slot
+// pos & mask. A slot's sequence number is pos when the slot is empty and ready
+// for the push at position pos, and pos + 1 once that push has filled it and
+// it is ready for the pop at the same position. The pop then sets it to
+// pos + capacity, ready for the push one trip around the ring later.
+
+void mpmc_init(struct mpmc_queue *q, unsigned int capacity)
+{
+  if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+    printf("mpmc_init: capacity %d is not a power of two\n", capacity);
+    shutdown();
+  }
+  q->slots = malloc(capacity * sizeof(struct mpmc_slot));
+  for (int i = 0; i < capacity; i++) {
+    q->slots[i].seq = i;
+    q->slots[i].item = 0;
+  }
+  q->mask = capacity - 1;
+  q->head = 0;
+  q->tail = 0;
+}
+
+int mpmc_push(struct mpmc_queue *q, void *item)
+{
+  unsigned int pos = q->tail;
+  struct mpmc_slot *slot;
+  while (1) {
+    slot = &q->slots[pos & q->mask];
+    int diff = (int)(slot->seq - pos);
+    if (diff == 0) {
+      // slot is empty; try to claim it
+      unsigned int old = atomic_cas(&q->tail, pos, pos + 1);
+      if (old == pos)
+	break;
+      pos = old; // another producer got it first
+    } else if (diff < 0) {
+      return 0; // slot still holds an item from the last trip: queue is full
+    } else {
+      pos = q->tail; // another producer already filled it; catch up
+    }
+  }
+  slot->item = item;
+  compiler_barrier();
+  slot->seq = pos + 1;
+  return 1;
+}
+
+void *mpmc_pop(struct mpmc_queue *q)
+{
+  unsigned int pos = q->head;
+  struct mpmc_slot *slot;
+  while (1) {
+    slot = &q->slots[pos & q->mask];
+    int diff = (int)(slot->seq - (pos + 1));
+    if (diff == 0) {
+      // slot is full; try to claim it
+      unsigned int old = atomic_cas(&q->head, pos, pos + 1);
+      if (old == pos)
+	break;
+      pos = old; // another consumer got it first
+    } else if (diff < 0) {
+      return 0; // slot hasn't been filled yet: queue is empty
+    } else {
+      pos = q->head; // another consumer already emptied it; catch up
+    }
+  }
+  void *item = slot->item;
+  compiler_barrier();
+  slot->seq = pos + q->mask + 1;
+  return item;
+}
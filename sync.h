@@ -0,0 +1,298 @@
+#ifndef SYNC_H_
+#define SYNC_H_
+
+/* Multi-core synchronization primitives.
+ *
+ * The low-level parts are written in assembly in machine.s, using the MIPS LL
+ * and SC instructions. The wrappers here add per-lock contention counters.
+ *
+ * None of these locks protect against interrupts on the same core, so code
+ * that might also be called from an interrupt handler should disable
+ * interrupts before taking the lock:
+ *
+ *  int level = intr_disable();
+ *  spin_lock(&lock);
+ *  ...
+ *  spin_unlock(&lock);
+ *  intr_restore(level);
+ */
+
+// Change to 0 to stop counting acquisitions and spins for every lock. The
+// counters are only ever updated by the core holding the lock, so they need no
+// extra synchronization.
+#define LOCK_STATS 1
+
+/* machine.s */
+
+unsigned int spin_acquire(volatile unsigned int *word); // wait for *word == 0, then set it to 1; returns failed tries
+int spin_try(volatile unsigned int *word); // set *word from 0 to 1 and return 1, or return 0 if it wasn't 0
+void spin_release(volatile unsigned int *word); // set *word to 0
+
+struct ticketlock;
+unsigned int ticket_acquire(struct ticketlock *lock); // take a ticket and wait for it to be served; returns failed checks
+void ticket_release(struct ticketlock *lock); // serve the next ticket
+
+unsigned int atomic_swap(volatile unsigned int *p, unsigned int v); // set *p = v; returns old *p
+unsigned int atomic_cas(volatile unsigned int *p, unsigned int expected, unsigned int desired); // if *p == expected, set *p = desired; returns old *p
+unsigned int atomic_fetch_add(volatile unsigned int *p, unsigned int n); // add n to *p; returns old *p
+
+
+/* A simple test-and-set spinlock. It is as cheap as a lock can be when there is
+ * no contention, but makes no promises about fairness: when several cores are
+ * waiting, any of them might get it next. A lock should start out zeroed, which
+ * means unlocked. */
+
+struct spinlock {
+  volatile unsigned int held; // 1 if some core holds the lock, 0 otherwise
+  unsigned int acquisitions; // times the lock was taken
+  unsigned int spins; // failed tries while waiting for it
+};
+
+static inline void spin_lock(struct spinlock *lock)
+{
+  unsigned int spins = spin_acquire(&lock->held);
+#if LOCK_STATS
+  lock->acquisitions++;
+  lock->spins += spins;
+#else
+  (void)spins;
+#endif
+}
+
+// take the lock and return 1 if it is free, otherwise return 0 right away
+static inline int spin_trylock(struct spinlock *lock)
+{
+  if (!spin_try(&lock->held))
+    return 0;
+#if LOCK_STATS
+  lock->acquisitions++;
+#endif
+  return 1;
+}
+
+static inline void spin_unlock(struct spinlock *lock)
+{
+  spin_release(&lock->held);
+}
+
+
+/* A ticket lock. Each core takes a numbered ticket, then waits for its number
+ * to be served, so cores get the lock in the order they asked for it. A lock
+ * should start out zeroed, which means unlocked. */
+
+struct ticketlock {
+  volatile unsigned int next; // next ticket to hand out
+  volatile unsigned int serving; // ticket currently allowed to hold the lock
+  unsigned int acquisitions; // times the lock was taken
+  unsigned int spins; // failed checks while waiting for it
+};
+
+static inline void ticket_lock(struct ticketlock *lock)
+{
+  unsigned int spins = ticket_acquire(lock);
+#if LOCK_STATS
+  lock->acquisitions++;
+  lock->spins += spins;
+#else
+  (void)spins;
+#endif
+}
+
+static inline void ticket_unlock(struct ticketlock *lock)
+{
+  ticket_release(lock);
+}
+
+
+/* An MCS queue lock. Waiting cores form a queue, and each one spins on a flag
+ * in its own queue node rather than on a single shared word, so handing off
+ * the lock costs the same no matter how many cores are waiting. Cores get the
+ * lock in the order they asked for it. Every lock has one queue node per core,
+ * picked with current_cpu_id(), so a core can hold several different MCS locks
+ * at once, but must not try to take the same one twice. A lock should start
+ * out zeroed, which means unlocked. The nodes are 64-byte aligned, so a lock
+ * must not be put anywhere that can't honour that alignment (e.g. malloc()). */
+
+struct mcs_node {
+  struct mcs_node *volatile next; // next core in the queue, once it has linked itself in
+  volatile unsigned int waiting; // 1 until the previous core hands over the lock
+} __attribute__((aligned(64))); // each core's node on its own 64-byte line
+
+struct mcs_lock {
+  struct mcs_node *volatile tail; // last core in the queue, or 0 if unlocked
+  unsigned int acquisitions; // times the lock was taken
+  unsigned int spins; // checks of the waiting flag that found it still set
+  struct mcs_node node[MAX_CORES];
+};
+
+
+/* A sequence lock, for small blocks of read-mostly data, such as statistics,
+ * that span several words (including 64-bit counters, which this 32-bit
+ * machine can't read or write in one go). Writers take an ordinary spinlock
+ * among themselves and bump a sequence number before and after each update,
+ * so the number is odd while an update is in progress. Readers never take the
+ * lock and never hold up a writer; they just copy the data out and retry if the
+ * sequence number shows a writer got in the way:
+ *
+ *  unsigned int seq;
+ *  do {
+ *    seq = seq_read_begin(&lock);
+ *    copy = data;
+ *  } while (seq_read_retry(&lock, seq));
+ *
+ * Since the copy might be torn while it is being made, a reader should not act
+ * on the copied values (e.g. follow pointers) until seq_read_retry() says the
+ * copy is good. A lock should start out zeroed. */
+
+// keep the compiler from moving loads and stores across this point; the
+// hardware itself never reorders memory accesses, so nothing else is needed
+#define compiler_barrier() __asm__ __volatile__ ("" ::: "memory")
+
+struct seqlock {
+  volatile unsigned int seq; // odd while a writer is updating the data
+  struct spinlock writer; // serializes writers
+};
+
+static inline void seq_write_lock(struct seqlock *lock)
+{
+  spin_lock(&lock->writer);
+  lock->seq++;
+  compiler_barrier();
+}
+
+static inline void seq_write_unlock(struct seqlock *lock)
+{
+  compiler_barrier();
+  lock->seq++;
+  spin_unlock(&lock->writer);
+}
+
+static inline unsigned int seq_read_begin(struct seqlock *lock)
+{
+  unsigned int seq;
+  while ((seq = lock->seq) & 1)
+    ; // a writer is in the middle of an update
+  compiler_barrier();
+  return seq;
+}
+
+// returns 1 if the data read since seq_read_begin() might be inconsistent
+static inline int seq_read_retry(struct seqlock *lock, unsigned int seq)
+{
+  compiler_barrier();
+  return lock->seq != seq;
+}
+
+
+/* A bounded multi-producer, multi-consumer queue of pointers, which any number
+ * of cores can push to and pop from at once without taking a lock (D. Vyukov's
+ * design). The queue is a ring of slots, each with a sequence number that says
+ * whether the slot is ready to be filled or ready to be emptied for the current
+ * trip around the ring. A producer claims a slot by advancing the tail with
+ * atomic_cas(), fills it, then publishes it by bumping the slot's sequence
+ * number; consumers do the same with the head. The head and tail are on
+ * separate cache lines, so producers and consumers don't slow each other down
+ * when the queue is neither full nor empty. */
+
+struct mpmc_slot {
+  volatile unsigned int seq;
+  void *volatile item;
+};
+
+struct mpmc_queue {
+  volatile unsigned int tail; // position of the next push
+  unsigned int pad0[15];
+  volatile unsigned int head; // position of the next pop
+  unsigned int pad1[15];
+  unsigned int mask; // capacity - 1
+  struct mpmc_slot *slots;
+};
+
+
+/* A reusable sense-reversing barrier. Each of n cores calls barrier_wait(),
+ * and none of them returns until all n have arrived. The barrier can be used
+ * again right away, by the same or a different set of n cores: each round flips
+ * the shared sense, and every core remembers which sense it last waited for,
+ * so a fast core can't slip through the next round while slow ones are still
+ * leaving this one. A barrier should start out zeroed. */
+
+struct barrier {
+  volatile unsigned int count; // cores that have arrived in this round
+  volatile unsigned int sense; // flipped by the last core to arrive
+  unsigned char local_sense[MAX_CORES]; // sense each core waited for last
+};
+
+
+/* A counter that many cores bump often, e.g. a total of dropped packets. Each
+ * core adds to a pending count of its own, on its own cache line, and only
+ * flushes that into the shared total with atomic_fetch_add() once it reaches
+ * BATCHED_COUNTER_BATCH, or when batched_flush() is called. So the total costs
+ * about one atomic operation per BATCHED_COUNTER_BATCH increments rather than
+ * one per increment, at the price of lagging behind by up to that much per
+ * core. A counter should start out zeroed. A core's pending count is not
+ * protected from interrupt handlers on the same core, so don't bump the same
+ * counter from both. */
+
+#define BATCHED_COUNTER_BATCH 64
+
+struct batched_counter {
+  volatile unsigned int total; // sum of everything flushed so far
+  unsigned int pad[15];
+  struct {
+    unsigned int pending; // added on this core but not yet flushed
+    unsigned int pad[15];
+  } core[MAX_CORES];
+};
+
+// move this core's pending count into the total
+static inline void batched_flush(struct batched_counter *c)
+{
+  unsigned int *pending = &c->core[current_cpu_id()].pending;
+  if (*pending) {
+    atomic_fetch_add(&c->total, *pending);
+    *pending = 0;
+  }
+}
+
+static inline void batched_add(struct batched_counter *c, unsigned int n)
+{
+  unsigned int *pending = &c->core[current_cpu_id()].pending;
+  *pending += n;
+  if (*pending >= BATCHED_COUNTER_BATCH) {
+    atomic_fetch_add(&c->total, *pending);
+    *pending = 0;
+  }
+}
+
+// the total so far, not counting anything still pending on any core
+static inline unsigned int batched_read(struct batched_counter *c)
+{
+  return c->total;
+}
+
+
+/* sync.c */
+
+void mcs_lock(struct mcs_lock *lock);
+void mcs_unlock(struct mcs_lock *lock);
+
+// wait until n cores (including this one) have called barrier_wait() on b
+void barrier_wait(struct barrier *b, unsigned int n);
+
+// compare spinlocks, ticket locks, and MCS locks with 2, 8, and 32 cores all
+// fighting over the same lock; every core must call this, and core 0 prints
+// the results
+void lock_benchmark();
+
+// set up an empty queue with room for capacity items, which must be a power of
+// two; the slots come from malloc()
+void mpmc_init(struct mpmc_queue *q, unsigned int capacity);
+
+// add an item to the queue; returns 1 on success, or 0 if the queue is full
+int mpmc_push(struct mpmc_queue *q, void *item);
+
+// remove the oldest item from the queue; returns 0 if the queue is empty, so
+// null pointers shouldn't be pushed
+void *mpmc_pop(struct mpmc_queue *q);
+
+#endif
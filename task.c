@@ -0,0 +1,136 @@
+#include "kernel.h"
+
+// Cooperative tasks for background work.
+//
+// A task is a function running on its own small stack. Tasks never preempt
+// each other, or anything else: a task runs until it calls task_yield(), and
+// other code runs tasks by calling task_yield() too, at points where a pause is
+// harmless (e.g. sched_run() when there are no work items to run). Each core
+// has its own run queue, and tasks never move between cores, so none of this
+// needs any locking.
+//
+// The code that was running on a core before it ever yielded (e.g. __boot() and
+// sched_run(), on the boot stack) is treated as one more task, the core's main
+// task, so that yielding from a background task eventually gets back to it.
+//
+// Switching saves and restores only the registers that a function call must
+// preserve, using the same struct mips_core_data layout as the trap handler.
+// Each task's struct lives at the bottom of its own stack pages, so creating a
+// task takes a single alloc_pages() call. A task that returns is freed by
+// whichever task runs next, since it can't free the stack it is running on.
+
+#define TASK_STACK_PAGES 2 // 8 KB per task, including the struct task
+
+struct task {
+  struct mips_core_data regs; // saved registers, while not running
+  void (*fn)(void *arg);
+  void *arg;
+  struct task *next; // next in run queue
+};
+
+struct task_queue {
+  struct task main; // the core's main task
+  struct task *current; // task running now, or 0 if the main task has never yielded
+  struct task *head, *tail; // tasks ready to run, oldest first
+  struct task *zombie; // task that just finished, waiting to be freed
+  unsigned int count; // tasks alive on this core, not counting the main task
+  unsigned int switches; // total task switches on this core
+};
+
+static DEFINE_PER_CPU(struct task_queue, task_queue);
+
+// in machine.s
+void task_switch(struct mips_core_data *save, struct mips_core_data *load);
+void task_start();
+
+static void task_enqueue(struct task_queue *q, struct task *t)
+{
+  t->next = 0;
+  if (q->tail)
+    q->tail->next = t;
+  else
+    q->head = t;
+  q->tail = t;
+}
+
+static struct task *task_dequeue(struct task_queue *q)
+{
+  struct task *t = q->head;
+  if (t) {
+    q->head = t->next;
+    if (!q->head)
+      q->tail = 0;
+  }
+  return t;
+}
+
+// free the task that finished just before we started running, if any
+static void task_reap(struct task_queue *q)
+{
+  if (q->zombie) {
+    free_pages(q->zombie, TASK_STACK_PAGES);
+    q->zombie = 0;
+    q->count--;
+  }
+}
+
+void task_spawn(void (*fn)(void *arg), void *arg)
+{
+  struct task_queue *q = &PER_CPU(task_queue);
+  struct task *t = alloc_pages(TASK_STACK_PAGES);
+  t->fn = fn;
+  t->arg = arg;
+  // the first switch into this task "returns" to task_start(), which calls
+  // task_main(t) on the fresh stack, leaving room for a0-a3 as usual
+  t->regs.R[16] = (unsigned int)t;
+  t->regs.R[28] = current_cpu_gp();
+  t->regs.R[29] = (unsigned int)t + TASK_STACK_PAGES * PAGE_SIZE - 16;
+  t->regs.R[30] = t->regs.R[29];
+  t->regs.R[31] = (unsigned int)task_start;
+  q->count++;
+  task_enqueue(q, t);
+}
+
+void task_yield()
+{
+  struct task_queue *q = &PER_CPU(task_queue);
+  if (!q->head)
+    return; // nothing else to run
+  struct task *prev = q->current ? q->current : &q->main;
+  struct task *next = task_dequeue(q);
+  task_enqueue(q, prev);
+  q->current = next;
+  q->switches++;
+  task_switch(&prev->regs, &next->regs);
+  task_reap(q);
+}
+
+// switch away from a task that has finished, for good
+static void task_exit()
+{
+  struct task_queue *q = &PER_CPU(task_queue);
+  struct task *prev = q->current;
+  // the main task never exits, so it is always somewhere in the queue
+  struct task *next = task_dequeue(q);
+  q->zombie = prev;
+  q->current = next;
+  q->switches++;
+  task_switch(&prev->regs, &next->regs);
+}
+
+// called by task_start() in machine.s, on the task's own stack
+void task_main(struct task *t)
+{
+  task_reap(&PER_CPU(task_queue));
+  t->fn(t->arg);
+  task_exit();
+}
+
+void task_print_stats()
+{
+  printf("task stats:\n");
+  for (int i = 0; i < current_cpu_exists(); i++) {
+    struct task_queue *q = &PER_CPU_OF(task_queue, i);
+    printf("  core %2d: %4u tasks, %8u switches\n", i, q->count, q->switches);
+  }
+}
@@ -0,0 +1,185 @@
+#include "kernel.h"
+
+// Periodic timer tick and deferred callbacks.
+//
+// The tick comes from the MIPS Count and Compare registers: Count (what
+// current_cpu_cycles() reads) goes up by one every cycle, and when it reaches
+// Compare, the timer interrupt goes off. Writing Compare also clears the
+// interrupt, so each tick just moves Compare one tick further on. Only core 0
+// gets interrupts, so only core 0 runs the tick. The tick length defaults to
+// TIMER_DEFAULT_TICK cycles, and can be changed with a "tick=N" boot parameter
+// (in cycles).
+//
+// Callbacks hang off a timer wheel of TIMER_WHEEL_SIZE slots, one per tick,
+// wrapping around. A timer due at tick t sits in slot t % TIMER_WHEEL_SIZE, so
+// each tick only looks at the timers in one slot; ones due further out than one
+// trip around the wheel just stay put until their tick comes around. Adding and
+// cancelling timers is protected by a spinlock, with interrupts disabled, so
+// any core can do it. The tick count itself only changes under the same lock,
+// so a timer is never added to a slot that has just been handled.
+//
+// If interrupts were off for longer than a tick, the next interrupt counts every
+// tick that went by, so ticks always count elapsed time, and runs the timers
+// that were due in any of them, so none is ever skipped. But a periodic timer
+// runs only once per interrupt, however many of its periods went by, and is
+// re-armed a full period from the current tick, so that callbacks like stats
+// windows never see a burst of back-to-back calls. Periodic timers are put back on the wheel in the same
+// critical section that takes them off it, so timer_cancel() always finds a
+// timer that hasn't been cancelled yet; but like any callback that has already
+// been picked up to run, it might still run once more after being cancelled.
+
+#define TIMER_DEFAULT_TICK 10000 // cycles per tick, i.e. 10 ms
+#define TIMER_WHEEL_SIZE 64 // must be a power of two
+
+static unsigned int tick_cycles; // cycles per tick, or 0 if the timer is off
+static volatile unsigned int ticks; // ticks since timer_init()
+static unsigned int next_compare; // value of Compare for the next tick
+static unsigned int late_ticks; // ticks handled late, because interrupts were off too long
+
+static struct timer *wheel[TIMER_WHEEL_SIZE];
+static struct spinlock wheel_lock;
+
+void timer_init()
+{
+  tick_cycles = bootparam_int("tick", TIMER_DEFAULT_TICK);
+  if (tick_cycles == 0)
+    return;
+  next_compare = current_cpu_cycles() + tick_cycles;
+  set_cpu_compare(next_compare);
+  // allow timer interrupts
+  set_cpu_status(current_cpu_status() | (1 << (8+INTR_TIMER)));
+  printf("timer: ticking every %d cycles\n", tick_cycles);
+}
+
+unsigned int timer_ticks()
+{
+  return ticks;
+}
+
+unsigned int timer_usec_to_ticks(unsigned int usec)
+{
+  if (tick_cycles == 0)
+    return 0;
+  unsigned int n = (unsigned long long)usec * CPU_CYCLES_PER_USEC / tick_cycles;
+  return n ? n : 1;
+}
+
+// put t in its slot; wheel_lock must be held
+static void timer_insert(struct timer *t)
+{
+  struct timer **slot = &wheel[t->expires & (TIMER_WHEEL_SIZE - 1)];
+  t->next = *slot;
+  *slot = t;
+}
+
+// take t out of its slot, if it is there; returns 1 if it was; wheel_lock must
+// be held
+static int timer_remove(struct timer *t)
+{
+  for (struct timer **p = &wheel[t->expires & (TIMER_WHEEL_SIZE - 1)]; *p; p = &(*p)->next) {
+    if (*p == t) {
+      *p = t->next;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void timer_start(struct timer *t, unsigned int delay, unsigned int period, void (*fn)(void *arg), void *arg)
+{
+  if (delay == 0)
+    delay = 1; // the current tick has already been handled
+  int level = intr_disable();
+  spin_lock(&wheel_lock);
+  timer_remove(t); // in case it was still pending
+  t->fn = fn;
+  t->arg = arg;
+  t->period = period;
+  t->expires = ticks + delay;
+  timer_insert(t);
+  spin_unlock(&wheel_lock);
+  intr_restore(level);
+}
+
+void timer_add(struct timer *t, unsigned int delay, void (*fn)(void *arg), void *arg)
+{
+  timer_start(t, delay, 0, fn, arg);
+}
+
+void timer_every(struct timer *t, unsigned int period, void (*fn)(void *arg), void *arg)
+{
+  timer_start(t, period, period ? period : 1, fn, arg);
+}
+
+int timer_cancel(struct timer *t)
+{
+  int level = intr_disable();
+  spin_lock(&wheel_lock);
+  int found = timer_remove(t);
+  spin_unlock(&wheel_lock);
+  intr_restore(level);
+  return found;
+}
+
+// run every timer due at tick t_due (either the current tick, t_now, or one
+// that went by while interrupts were off), re-arming periodic ones a period
+// after t_now; timers come off the wheel one at a time, and each is called
+// without holding the lock, so callbacks can add, re-add, or cancel timers
+static void timer_run_due(unsigned int t_due, unsigned int t_now)
+{
+  while (1) {
+    void (*fn)(void *arg) = 0;
+    void *arg = 0;
+    spin_lock(&wheel_lock);
+    for (struct timer **p = &wheel[t_due & (TIMER_WHEEL_SIZE - 1)]; *p; p = &(*p)->next) {
+      struct timer *t = *p;
+      if (t->expires == t_due) {
+	*p = t->next;
+	if (t->period) {
+	  t->expires = t_now + t->period;
+	  timer_insert(t);
+	}
+	fn = t->fn;
+	arg = t->arg;
+	break;
+      }
+    }
+    spin_unlock(&wheel_lock);
+    if (!fn)
+      return;
+    fn(arg);
+  }
+}
+
+void timer_interrupt()
+{
+  // note: interrupts are off already, and this only ever runs on core 0
+  if (tick_cycles == 0) {
+    set_cpu_compare(current_cpu_compare()); // clear it and move on
+    return;
+  }
+
+  // schedule the next tick, after catching up on any we were late for
+  unsigned int elapsed = 1;
+  next_compare += tick_cycles;
+  unsigned int now = current_cpu_cycles();
+  if ((int)(next_compare - now) <= 0) {
+    unsigned int behind = (now - next_compare) / tick_cycles + 1;
+    late_ticks += behind;
+    elapsed += behind;
+    next_compare += behind * tick_cycles;
+  }
+  set_cpu_compare(next_compare);
+
+  spin_lock(&wheel_lock);
+  ticks += elapsed;
+  unsigned int t_now = ticks;
+  spin_unlock(&wheel_lock);
+  for (unsigned int t_due = t_now - elapsed + 1; t_due != t_now + 1; t_due++)
+    timer_run_due(t_due, t_now);
+}
+
+void timer_print_stats()
+{
+  printf("timer: %u ticks of %u cycles, %u handled late\n", ticks, tick_cycles, late_ticks);
+}
@@ -1,53 +1,13 @@
-
-.bss
-
-.global trap_save_state
-trap_save_state:
-/* struct mips_core_data */
-.word 0 /* r0 */
-.word 0 /* r1 */
-.word 0 /* r2 */
-.word 0 /* r3 */
-.word 0 /* r4 */
-.word 0 /* r5 */
-.word 0 /* r6 */
-.word 0 /* r7 */
-.word 0 /* r8 */
-.word 0 /* r9 */
-.word 0 /* r10 */
-.word 0 /* r11 */
-.word 0 /* r12 */
-.word 0 /* r13 */
-.word 0 /* r14 */
-.word 0 /* r15 */
-.word 0 /* r16 */
-.word 0 /* r17 */
-.word 0 /* r18 */
-.word 0 /* r19 */
-.word 0 /* r20 */
-.word 0 /* r21 */
-.word 0 /* r22 */
-.word 0 /* r23 */
-.word 0 /* r24 */
-.word 0 /* r25 */
-.word 0 /* r26 */
-.word 0 /* r27 */
-.word 0 /* r28 */
-.word 0 /* r29 */
-.word 0 /* r30 */
-.word 0 /* r31 */
-.word 0 /* LO */
-.word 0 /* HI */
-.word 0 /* PC */
-
 .section .traphandler /* linker will put this code at the appropriate place in memory */
 
 /* extern void trap_handler(struct mips_core_data *save_state, unsigned int status, unsigned int cause) */
 .extern trap_handler 
 
-/* extern void *trap_stack_top; */
+/* per-core variables, see DEFINE_PER_CPU in kernel.h */
+.extern trap_save_state
 .extern trap_stack_top
 .extern trap_gp
+.extern percpu_offset
 
 .func	trap
 .type	trap, @function
@@ -57,9 +17,14 @@ trap:
   mfc0 $27, $16
   sll  $27, $27, 2	  /* r27 = 4*ID */
 
-  /* figure out where to save state, namely, trap_save_state[id] */
-  la $26, trap_save_state /* r26 = pointer to [array of pointers to save-state structs] */
+  /* find this core's copy of the per-core variables, namely percpu_offset[id] */
+  la $26, percpu_offset	  /* r26 = pointer to [array of per-core offsets] */
   add $26, $26, $27	  /* r26 = pointer to i-th element of array */
+  lw $27, 0($26)	  /* r27 = offset from per-core template to this core's copy */
+
+  /* figure out where to save state, namely, this core's trap_save_state */
+  la $26, trap_save_state /* r26 = pointer to template copy of trap_save_state */
+  add $26, $26, $27	  /* r26 = pointer to this core's copy */
   lw $26, 0($26)	  /* r26 = pointer to save-state struct  */
 
   /* save all state */
@@ -104,13 +69,13 @@ trap:
   sw $10, 136($26) /* PC (actually, EPC) */
 
   /* set up kernel stack and global pointer */
-  la $10, trap_stack_top /* r10 = pointer to [array of stack addresses] */
-  add $10, $27		 /* r10 = pointer to i-th element of array */
-  lw $sp, 0($10)	 /* sp = i-th element of array */
+  la $10, trap_stack_top /* r10 = pointer to template copy of trap_stack_top */
+  add $10, $27		 /* r10 = pointer to this core's copy */
+  lw $sp, 0($10)	 /* sp = this core's trap stack */
 
-  la $10, trap_gp	 /* r10 = pointer to [array of gp addresses] */
-  add $10, $27		 /* r10 = pointer to i-th element of array */
-  lw $gp, 0($10)	 /* gp = i-th element of array */
+  la $10, trap_gp	 /* r10 = pointer to template copy of trap_gp */
+  add $10, $27		 /* r10 = pointer to this core's copy */
+  lw $gp, 0($10)	 /* gp = this core's trap $gp */
 
   addi $sp, $sp, -4
   move $fp, $sp